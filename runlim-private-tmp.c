@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+/* Installed setuid root for 'runlim --private-tmp=<size>' if user name
+ * spaces are disabled.  Mounts a 'tmpfs' of '<size>' MB on '/tmp' in a
+ * new mount namespace, drops privileges and then executes the program.
+ * Thus any local user ends up in a private mount namespace, which apart
+ * from '/tmp' (mounted 'nosuid') is a copy of the original one, and from
+ * which setuid binaries can still be executed.  The size is checked
+ * strictly and limited by physical memory, since the caller is not
+ * trusted.
+ */
+
+static long
+parse_size (const char * str)
+{
+  long res, max_size;
+  char * end;
+
+  errno = 0;
+  res = strtol (str, &end, 10);
+  if (errno || end == str || *end || res <= 0)
+    return -1;
+
+  max_size = sysconf (_SC_PHYS_PAGES);
+  if (max_size <= 0 || max_size > LONG_MAX / sysconf (_SC_PAGESIZE))
+    max_size = LONG_MAX;
+  else
+    max_size *= sysconf (_SC_PAGESIZE);
+  max_size >>= 20;
+
+  return res > max_size ? -1 : res;
+}
+
+int
+main (int argc, char ** argv)
+{
+  char options[64];
+  long size;
+
+  if (argc < 3 || (size = parse_size (argv[1])) <= 0)
+    {
+      fprintf (stderr, "usage: runlim-private-tmp <size> program [arg ...]\n"
+                       "(size in MB at most physical memory)\n");
+      return 1;
+    }
+
+  sprintf (options, "size=%ldm,mode=1777", size);
+  if (unshare (CLONE_NEWNS) ||
+      mount ("none", "/", 0, MS_REC | MS_PRIVATE, 0) ||
+      mount ("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, options))
+    {
+      perror ("runlim-private-tmp: can not mount private '/tmp'");
+      return 1;
+    }
+
+  if (setgid (getgid ()) || setuid (getuid ()) ||
+      (getuid () && !setuid (0)))
+    {
+      fprintf (stderr, "runlim-private-tmp: can not drop privileges\n");
+      return 1;
+    }
+
+  execvp (argv[2], argv + 2);
+  perror (argv[2]);
+  return 1;
+}
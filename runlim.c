@@ -2,23 +2,43 @@
      See LICENSE for copyright and restrictions on using this software.
 \*------------------------------------------------------------------------*/
 
+#define _GNU_SOURCE
+
 #include <asm/param.h>
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/magic.h>
+#include <linux/mempolicy.h>
+#include <linux/netlink.h>
+#include <linux/perf_event.h>
+#include <sys/inotify.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sched.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -27,10 +47,18 @@
 #define SAMPLE_RATE 100000l	/* in microseconds */
 #define REPORT_RATE 100l	/* in terms of sampling */
 #define KILL_DELAY 512l		/* in milliseconds */
+#define SMAPS_RATE 10l		/* in terms of sampling */
+#define WRITE_RATE_WINDOW 1.0	/* in seconds */
+#define MIN_SAMPLE_RATE 10000l	/* in microseconds */
+#define MAX_SAMPLE_RATE 1000000l	/* in microseconds */
 
 /*------------------------------------------------------------------------*/
 
+typedef struct Entry Entry;
+typedef struct Histogram Histogram;
+typedef struct Placement Placement;
 typedef struct Process Process;
+typedef struct Sample Sample;
 typedef enum Status Status;
 
 /*------------------------------------------------------------------------*/
@@ -40,6 +68,9 @@ enum Status
   OK = 0,
   OUT_OF_TIME = 1,
   OUT_OF_MEMORY = 2,
+  OUT_OF_INSTRUCTIONS = 3,
+  OUT_OF_IO = 4,
+  OUT_OF_DISK = 5,
   BUS_ERROR = 7,
   SEGMENTATION_FAULT = 11,
   OTHER_SIGNAL = 100,
@@ -50,23 +81,85 @@ enum Status
 
 /*------------------------------------------------------------------------*/
 
+#define READ_BYTES_IO 0
+#define WRITE_BYTES_IO 1
+#define READ_CALLS_IO 2
+#define WRITE_CALLS_IO 3
+#define NUM_IO 4
+
+/* Fields used in every sample come first and share the first cache line
+ * (or two).  Records are allocated in blocks (see 'new_process') and the
+ * command name points into a pool of interned names.
+ */
+
 struct Process
 {
-  char new;
-  char active;
-  char cyclic_sampling;
-  char cyclic_killing;
   int pid;
   int ppid;
   long sampled;
   double time;
   double memory;
-  char name[1000];
   Process * next_process;
+  Process * parent;
   Process * first_child;
   Process * last_child;
-  Process * parent;
+  Process * prev_sibbling;
   Process * next_sibbling;
+  char active;
+  char descendant;
+  char zombie;
+  char signalled;
+  int stat_fd;
+  int victim;
+  long smaps_sampled;
+  double smaps_rss;
+  double smaps_memory;
+  double io[NUM_IO];
+  const char * name;
+};
+
+/*------------------------------------------------------------------------*/
+
+/* Entry of the scratch directory (see 'sample_scratch').
+ */
+
+struct Entry
+{
+  int wd;
+  char dirty;
+  double bytes;
+  char name[];
+};
+
+/*------------------------------------------------------------------------*/
+
+/* Values are counted in log-linear buckets, eight per power of two, which
+ * gives percentiles within about six percent.
+ */
+
+#define HISTOGRAM_SIZE 496
+
+struct Histogram
+{
+  long count;
+  double min;
+  double max;
+  long bucket[HISTOGRAM_SIZE];
+};
+
+/*------------------------------------------------------------------------*/
+
+struct Sample
+{
+  double time;
+  double real;
+  double memory;
+  double load;
+  double instructions;
+  double cycles;
+  double read_bytes;
+  double written_bytes;
+  double disk;
 };
 
 /*------------------------------------------------------------------------*/
@@ -95,24 +188,95 @@ struct Process
 "  --sample-rate=<number>     sample rate in microseconds " \
 "(default %ld)\n" \
 "\n" \
+"  --adaptive-sampling        sample faster when getting close to limits\n" \
+"  --min-sample-rate=<number> fastest adaptive sample rate " \
+"(default %ld)\n" \
+"  --max-sample-rate=<number> slowest adaptive sample rate " \
+"(default %ld)\n" \
+"\n" \
 "  --report-rate=<number>     report rate in terms of sampling " \
 "(default %ld)\n" \
 "\n" \
-"  --kill-delay=<number>      initial kill delay " \
+"  --kill-delay=<number>      grace period before killing " \
 "(default %ld milliseconds)\n" \
 "\n" \
+"  --memory-metric=<metric>   count memory as 'rss' (default), 'pss'\n" \
+"                             (shared pages split) or 'uss' (private)\n" \
+"\n" \
+"  --smaps-rate=<number>      read 'smaps_rollup' for 'pss' and 'uss'\n" \
+"                             every <number> samples (default %ld)\n" \
+"\n" \
 "  --debug                    print debugging information\n" \
 "  -d\n" \
 "\n" \
 "  --single                   assume single child process\n" \
 "\n" \
+"  --descendants              only read descendants of the child process\n" \
+"\n" \
+"  --process-events           track processes through kernel events\n" \
+"\n" \
+"  --cgroup[=<dir>]           account in a new cgroup v2 below '<dir>',\n" \
+"                             which has to be a delegated cgroup without\n" \
+"                             processes for memory accounting (default\n" \
+"                             is the cgroup of runlim)\n" \
+"\n" \
+"  --kernel-space-limit       let the kernel enforce the space limit\n" \
+"                             (implies '--cgroup')\n" \
+"\n" \
+"  --soft-space-limit=<number>\n" \
+"                             throttle the program above <number> MB\n" \
+"                             (implies '--cgroup')\n" \
+"\n" \
+"  --cpus=<list>              run on the given CPUs (like '0-3,8')\n" \
+"\n" \
+"  --cores=<number>           run on <number> cores of one NUMA node\n" \
+"\n" \
+"  --perf                     count instructions, cycles, cache and branch\n" \
+"                             misses with hardware performance counters\n" \
+"\n" \
+"  --instruction-limit=<number>\n" \
+"                             set limit of user space instructions\n" \
+"                             (implies '--perf')\n" \
+"\n" \
+"  --io                       account bytes read from and written to\n" \
+"                             storage and read and write calls\n" \
+"\n" \
+"  --write-limit=<number>     set limit of written bytes to <number> MB\n" \
+"                             (implies '--io')\n" \
+"\n" \
+"  --write-rate-limit=<number>\n" \
+"                             set limit of written MB per second (checked\n" \
+"                             every second, or throttled by the cgroup,\n" \
+"                             which then slows down but never stops\n" \
+"                             the program) (implies '--io')\n" \
+"\n" \
+"  --scratch[=<dir>]          run with a new scratch directory as 'TMPDIR'\n" \
+"                             (below '<dir>', '$TMPDIR' or '/tmp')\n" \
+"\n" \
+"  --disk-limit=<number>      set scratch directory limit to <number> MB\n" \
+"                             (implies '--scratch')\n" \
+"\n" \
+"  --private-tmp=<number>     run with a private '/tmp' of <number> MB\n" \
+"                             counted as space\n" \
+"\n" \
 "  --kill                     propagate signals\n" \
 "  -k\n" \
 "\n" \
 "  --propagate                propagate exit code\n" \
 "  -p\n" \
 "\n" \
-"The program is the name of an executable followed by its arguments.\n"
+"  --batch=<file>             run each line of <file> as a job\n" \
+"  --jobs=<number>            number of parallel jobs (default 1)\n" \
+"  -j <number>\n" \
+"\n" \
+"The program is the name of an executable followed by its arguments.\n" \
+"In batch mode each non-empty line of the job file not starting with '#'\n" \
+"is executed through '/bin/sh -c' under the given limits and one 'job'\n" \
+"line with job number, slot, status, result, real time, time, space and\n" \
+"the command is printed per job.  Finally the number of 'failed' jobs,\n" \
+"which did not have status 'ok' or exited with a non-zero result, is\n" \
+"printed.  With '--cpus' or '--cores' each slot runs its jobs on its\n" \
+"own disjoint set of CPUs.\n"
 
 /*------------------------------------------------------------------------*/
 
@@ -120,12 +284,16 @@ static FILE *log;
 static int close_log;
 static int debug_messages;
 
+static long batch_job;		/* job number in batch mode workers */
+static long batch_slot;		/* and its slot */
+
 /*------------------------------------------------------------------------*/
 
 static void
 usage (void)
 {
-  fprintf (log, USAGE, SAMPLE_RATE, REPORT_RATE, KILL_DELAY);
+  fprintf (log, USAGE, SAMPLE_RATE, MIN_SAMPLE_RATE, MAX_SAMPLE_RATE,
+    REPORT_RATE, KILL_DELAY, SMAPS_RATE);
   fflush (log);
 }
 
@@ -158,21 +326,18 @@ warning (const char * fmt, ...)
   fflush (log);
 }
 
-/* Messages are also generated while sampling, i.e., asynchronously
- * triggered by the timer in signal handlers, we have to be careful not to
- * garble sample messages with other messages.  The current solution is
- * better than the previous one using similar approaches as 'warning' and
- * 'error' but still not robust, which would need to use separate logging
- * threads.
+/* Messages are also generated while sampling and reporting in separate
+ * threads, so we have to be careful not to garble sample messages with
+ * other messages.  Each message is formatted into a buffer first and then
+ * written with a single (locked) 'fputs'.
 */
 
 static void
-message (const char * type, const char * fmt, ...)
+vmessage (const char * type, const char * fmt, va_list ap)
 {
   char buffer[1024];
   const size_t size_buffer = sizeof buffer - 1;
   size_t len;
-  va_list ap;
   assert (log);
   buffer[0] = 0;
   strncat (buffer, "[runlim] ", size_buffer);
@@ -183,14 +348,34 @@ message (const char * type, const char * fmt, ...)
   strncat (buffer, "\t", size_buffer);
   len = strlen (buffer);
   assert (len < size_buffer);
-  va_start (ap, fmt);
   vsnprintf (buffer + len, size_buffer - len, fmt, ap);
-  va_end (ap);
   strncat (buffer, "\n", size_buffer);
   fputs (buffer, log);
   fflush (log);
 }
 
+/* In batch mode workers only print their job line (and debug messages).
+ */
+
+static void
+message (const char * type, const char * fmt, ...)
+{
+  va_list ap;
+  if (batch_job && debug_messages <= 0) return;
+  va_start (ap, fmt);
+  vmessage (type, fmt, ap);
+  va_end (ap);
+}
+
+static void
+job_message (const char * fmt, ...)
+{
+  va_list ap;
+  va_start (ap, fmt);
+  vmessage ("job", fmt, ap);
+  va_end (ap);
+}
+
 #define debug(TYPE,FMT,ARGS...) \
 do { \
   if (debug_messages <= 0) break; \
@@ -272,6 +457,20 @@ parse_number_rhs (char *str)
   return res;
 }
 
+/* Limits given as option argument are only enabled if non-zero, thus zero
+ * would silently disable them and is rejected instead.
+ */
+static long
+parse_limit_rhs (char *str, const char * name)
+{
+  long res = parse_number_rhs (str);
+
+  if (res <= 0)
+    error ("invalid %s '%ld'", name, res);
+
+  return res;
+}
+
 /*------------------------------------------------------------------------*/
 
 static char * buffer;
@@ -435,6 +634,7 @@ static int session_pid = -1;
 
 static long num_samples;
 static long num_reports;
+static long num_reads;		/* of processes while sampling or killing */
 
 static long num_samples_since_last_report;
 
@@ -446,9 +646,10 @@ static double max_load;
 /*------------------------------------------------------------------------*/
 
 static int single;
+static int descendants;
+static int process_events;
 static int propagate_signals;
 static int propagate_exit_code;
-static int children;
 
 /*------------------------------------------------------------------------*/
 
@@ -456,13 +657,36 @@ static int children;
 
 #define PID_POS 1
 #define COMM_POS 2
+#define STATE_POS 3
 #define PPID_POS 4
 #define PGID_POS 5
 #define SESSION_POS 6
 #define UTIME_POS 14
 #define STIME_POS 15
+#define CUTIME_POS 16
+#define CSTIME_POS 17
+#define NUM_THREADS_POS 20
+#define STARTTIME_POS 22
 #define RSS_POS 24
-#define MAX_POS 24
+#define MAX_POS 52
+
+/*------------------------------------------------------------------------*/
+
+typedef struct Stat Stat;
+
+/* One parsed '/proc/<pid>/stat' line.  Numerical fields are stored at
+ * their position as given in 'man 5 proc' (thus 'field[UTIME_POS]' is the
+ * user time in clock ticks).  Positions not provided by the kernel stay
+ * zero.  The command name points into the read buffer and is only valid
+ * until the next call to 'read_stat'.
+ */
+struct Stat
+{
+  int fields;
+  char state;
+  const char * comm;
+  long long field[MAX_POS + 1];
+};
 
 /*------------------------------------------------------------------------*/
 
@@ -474,9 +698,22 @@ static double space_limit;
 
 /*------------------------------------------------------------------------*/
 
+/* Processes are deleted from the hash table as soon as they are flushed
+ * (see 'flush_inactive_processes').  Their slot is then marked by a
+ * tombstone, i.e., points to 'deleted_process', since open addressing
+ * requires look-ups to skip over it.  Tombstones are reused on insertion
+ * and dropped on resizing, which sizes the table by the number of live
+ * processes (and thus might shrink it).
+ */
+
 static Process ** process_hash_table;
 static size_t size_of_process_hash_table;
-static size_t processes;
+static size_t live_processes;		/* in hash table */
+static size_t deleted_processes;	/* tombstones in hash table */
+static size_t peak_processes;		/* maximum of 'live_processes' */
+static size_t processes;		/* seen in total */
+
+static Process deleted_process;
 
 #define PRIME1 10007
 #define PRIME2 27
@@ -501,24 +738,34 @@ static size_t mod_size_of_process_hash_table (size_t n)
   return n & (size_of_process_hash_table - 1);
 }
 
+/* Returns the slot of the process or otherwise the first tombstone or
+ * empty slot where it should be inserted.
+ */
 static Process **
 look_up_process_in_process_hash_table (int pid)
 {
+  Process ** res, ** deleted, * process;
   size_t hash, pos;
-  Process ** res, * process;
 
-  assert (size_of_process_hash_table > processes);
+  assert (size_of_process_hash_table >
+          live_processes + deleted_processes);
 
   hash = hash_process_id (pid);
   pos = mod_size_of_process_hash_table (hash);
+  deleted = 0;
 
   for (;;)
     {
       res = process_hash_table + pos;
       process = *res;
       if (!process)
-	return res;
-      if (process->pid == pid)
+	return deleted ? deleted : res;
+      if (process == &deleted_process)
+	{
+	  if (!deleted)
+	    deleted = res;
+	}
+      else if (process->pid == pid)
 	return res;
       pos = mod_size_of_process_hash_table (pos + PRIME2);
     }
@@ -534,21 +781,22 @@ resize_process_hash_table (void)
   old_size_of_process_hash_table = size_of_process_hash_table;
   old_process_hash_table = process_hash_table;
 
-  size_of_process_hash_table = 2*old_size_of_process_hash_table;
-  if (!size_of_process_hash_table)
-    size_of_process_hash_table = 2;
+  size_of_process_hash_table = 16;
+  while (size_of_process_hash_table < 4 * (live_processes + 1))
+    size_of_process_hash_table *= 2;
+  deleted_processes = 0;
 
   /* debug ("resize", "%zu", size_of_process_hash_table); */
 
   process_hash_table =
-    calloc (size_of_process_hash_table, sizeof (Process));
+    calloc (size_of_process_hash_table, sizeof *process_hash_table);
   if (!process_hash_table)
     error ("could not resize process hash table");
 
   for (pos = 0; pos < old_size_of_process_hash_table; pos++)
     {
       process = old_process_hash_table[pos];
-      if (!process)
+      if (!process || process == &deleted_process)
 	continue;
       pid = process->pid;
       p = look_up_process_in_process_hash_table (pid);
@@ -557,20 +805,162 @@ resize_process_hash_table (void)
   free (old_process_hash_table);
 }
 
+/*------------------------------------------------------------------------*/
+
+/* Process records are carved out of blocks of 'PROCESS_BLOCK_SIZE' records
+ * which are only released at the end, which keeps records of processes
+ * read in the same sample close together in memory.
+ */
+
+#define PROCESS_BLOCK_SIZE 256
+
+static Process ** process_blocks;
+static size_t size_process_blocks;
+static size_t num_process_blocks;
+static size_t free_in_process_block;
+
+static Process * free_processes;	/* linked through 'next_process' */
+
+static Process *
+new_process (void)
+{
+  Process * res;
+
+  if (free_processes)
+    {
+      res = free_processes;
+      free_processes = res->next_process;
+      return res;
+    }
+
+  if (!free_in_process_block)
+    {
+      if (num_process_blocks == size_process_blocks)
+	{
+	  size_process_blocks =
+	    size_process_blocks ? 2*size_process_blocks : 16;
+	  process_blocks = realloc (process_blocks,
+	    size_process_blocks * sizeof *process_blocks);
+	  if (!process_blocks)
+	    error ("out-of-memory reallocating process blocks");
+	}
+      res = malloc (PROCESS_BLOCK_SIZE * sizeof *res);
+      if (!res)
+	error ("could not allocate process block");
+      process_blocks[num_process_blocks++] = res;
+      free_in_process_block = PROCESS_BLOCK_SIZE;
+    }
+
+  res = process_blocks[num_process_blocks - 1];
+  res += PROCESS_BLOCK_SIZE - free_in_process_block--;
+
+  return res;
+}
+
+static void
+release_process_blocks (void)
+{
+  while (num_process_blocks)
+    free (process_blocks[--num_process_blocks]);
+  free (process_blocks);
+  process_blocks = 0;
+  size_process_blocks = 0;
+  free_in_process_block = 0;
+  free_processes = 0;
+}
+
+/* Most processes share a handful of command names, which are thus only
+ * stored once in a hash table of interned names.
+ */
+
+static char ** names;
+static size_t size_names;
+static size_t num_names;
+
+static size_t
+hash_name (const char * name)
+{
+  size_t res = 0;
+  while (*name)
+    res = PRIME1 * res + (unsigned char) *name++;
+  return res;
+}
+
+static char **
+look_up_name (const char * name)
+{
+  size_t pos = hash_name (name) & (size_names - 1);
+  char ** res;
+
+  while (*(res = names + pos) && strcmp (*res, name))
+    pos = (pos + 1) & (size_names - 1);
+
+  return res;
+}
+
+static const char *
+intern_name (const char * name)
+{
+  char ** old_names, ** p;
+  size_t old_size, pos;
+
+  if (num_names >= size_names/2)
+    {
+      old_names = names;
+      old_size = size_names;
+      size_names = size_names ? 2*size_names : 64;
+      names = calloc (size_names, sizeof *names);
+      if (!names)
+	error ("out-of-memory reallocating names");
+      for (pos = 0; pos < old_size; pos++)
+	if (old_names[pos])
+	  *look_up_name (old_names[pos]) = old_names[pos];
+      free (old_names);
+    }
+
+  p = look_up_name (name);
+  if (!*p)
+    {
+      *p = strdup (name);
+      if (!*p)
+	error ("out-of-memory copying name");
+      num_names++;
+    }
+
+  return *p;
+}
+
+static void
+release_names (void)
+{
+  size_t pos;
+  for (pos = 0; pos < size_names; pos++)
+    free (names[pos]);
+  free (names);
+  names = 0;
+  size_names = num_names = 0;
+}
+
+/*------------------------------------------------------------------------*/
+
 static Process *
 find_process (int pid)
 {
   Process * res, ** p;
 
-  if (processes >= size_of_process_hash_table/2)
+  if (live_processes + deleted_processes >= size_of_process_hash_table/2)
     resize_process_hash_table ();
 
   p = look_up_process_in_process_hash_table (pid);
   assert (p);
-  res = *p;
 
   res = *p;
-  if (res)
+  if (res == &deleted_process)
+    {
+      assert (deleted_processes > 0);
+      deleted_processes--;
+    }
+  else if (res)
     {
       assert (res->pid == pid);
       return res;
@@ -578,19 +968,221 @@ find_process (int pid)
 
   /* debug ("insert", "%d", pid); */
 
-  res = malloc (sizeof * res);
-  if (!res)
-    error ("could not allocate process data");
-
+  res = new_process ();
   memset (res, 0, sizeof *res);
   res->pid = pid;
+  res->stat_fd = -1;
 
   *p = res;
   processes++;
+  if (++live_processes > peak_processes)
+    peak_processes = live_processes;
+
+  return res;
+}
+
+/* Same as 'find_process' but does not insert missing processes.
+*/
+static Process *
+find_existing_process (int pid)
+{
+  Process * res;
+
+  if (!size_of_process_hash_table)
+    return 0;
+
+  res = *look_up_process_in_process_hash_table (pid);
+  if (res == &deleted_process)
+    return 0;
+
+  return res;
+}
+
+/* The record is put on the free list but other records might still point
+ * to it until the tree is connected again.
+ */
+static void
+delete_process (Process * p)
+{
+  Process ** q;
+
+  q = look_up_process_in_process_hash_table (p->pid);
+  assert (*q == p);
+  *q = &deleted_process;
+
+  assert (live_processes > 0);
+  live_processes--;
+  deleted_processes++;
+
+  p->next_process = free_processes;
+  free_processes = p;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* The process tree is maintained incrementally.  A process is linked to
+ * its parent when it is added or its parent changes and unlinked when it
+ * is flushed.  Processes whose parent is not (yet) in the table are kept
+ * as children of 'unlinked_processes' and linked as soon as their parent
+ * shows up.  With '--descendants' and '--process-events' orphaned
+ * descendants are reparented to runlim, which is then a child subreaper,
+ * and thus are adopted by the child process, the root of the tree.
+ * Descendants of the root are marked and stay marked, even if unlinked
+ * again after their parent terminated, since they are then adopted by the
+ * root anyhow.  Thus sampling and killing only need a flat pass over
+ * active processes.
+ */
+
+static int children;			/* descendants seen */
+static int walked;			/* tree at least once */
+
+static Process unlinked_processes;
+
+static int
+parent_process_id (Process * p)
+{
+  if (p->ppid == parent_pid)
+    return child_pid;
+  return p->ppid;
+}
+
+static void
+append_child (Process * parent, Process * p)
+{
+  assert (!p->parent);
+  assert (!p->prev_sibbling);
+  assert (!p->next_sibbling);
+
+  p->parent = parent;
+  p->prev_sibbling = parent->last_child;
+  if (parent->last_child)
+    parent->last_child->next_sibbling = p;
+  else
+    parent->first_child = p;
+  parent->last_child = p;
+}
+
+static void
+remove_child (Process * p)
+{
+  Process * parent = p->parent;
+
+  if (!parent)
+    return;
 
+  if (p->prev_sibbling)
+    p->prev_sibbling->next_sibbling = p->next_sibbling;
+  else
+    parent->first_child = p->next_sibbling;
+
+  if (p->next_sibbling)
+    p->next_sibbling->prev_sibbling = p->prev_sibbling;
+  else
+    parent->last_child = p->prev_sibbling;
+
+  p->parent = p->prev_sibbling = p->next_sibbling = 0;
+}
+
+/* Marks the sub-tree of the process as descendants without recursion.
+ * Children of marked processes are already marked and skipped.
+ */
+static void
+mark_descendants (Process * p)
+{
+  Process * q = p;
+
+  while (q)
+    {
+      if (!q->descendant)
+	{
+	  q->descendant = 1;
+	  children++;
+	  if (q->first_child)
+	    {
+	      q = q->first_child;
+	      continue;
+	    }
+	}
+      while (q != p && !q->next_sibbling)
+	q = q->parent;
+      q = (q == p) ? 0 : q->next_sibbling;
+    }
+}
+
+static Process *
+root_process (void)
+{
+  Process * res = find_process (child_pid);
+  mark_descendants (res);
   return res;
 }
 
+/* Only the root is inserted if missing.
+ */
+static Process *
+find_parent_process (Process * p)
+{
+  int ppid = parent_process_id (p);
+  if (ppid == child_pid)
+    return root_process ();
+  return find_existing_process (ppid);
+}
+
+static void
+link_process (Process * p)
+{
+  Process * parent, * q;
+
+  assert (!p->parent);
+
+  if (p->pid == child_pid)
+    {
+      mark_descendants (p);
+      return;
+    }
+
+  parent = find_parent_process (p);
+  for (q = parent; q && q != p; q = q->parent)
+    ;
+  if (q)
+    {
+      warning ("cyclic process dependencies");
+      return;
+    }
+
+  append_child (parent ? parent : &unlinked_processes, p);
+  if (parent && parent->descendant)
+    mark_descendants (p);
+}
+
+static void
+link_unlinked_processes (void)
+{
+  Process * p, * next;
+
+  for (p = unlinked_processes.first_child; p; p = next)
+    {
+      next = p->next_sibbling;
+      if (!find_parent_process (p))
+	continue;
+      remove_child (p);
+      link_process (p);
+    }
+}
+
+static void
+unlink_process (Process * p)
+{
+  Process * child;
+
+  remove_child (p);
+  while ((child = p->first_child))
+    {
+      remove_child (child);
+      append_child (&unlinked_processes, child);
+    }
+}
+
 /*------------------------------------------------------------------------*/
 
 static Process * active_processes;
@@ -599,8 +1191,14 @@ static Process * last_active_process;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static volatile int killing;
 
-static void
-add_process (pid_t pid, pid_t ppid, double time, double memory, char* name)
+/* Protects the process table if processes are also read while handling
+ * kernel process events (see '--process-events').
+ */
+static pthread_mutex_t process_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static Process *
+add_process (pid_t pid, pid_t ppid, double time, double memory,
+             const char * name)
 {
   const char * type;
   Process * p;
@@ -612,12 +1210,12 @@ add_process (pid_t pid, pid_t ppid, double time, double memory, char* name)
 
   if (p->active)
     {
-      p->new = 0;
-
       assert (p->pid == pid);
       if (p->ppid != ppid)
 	{
 	  p->ppid = ppid;
+	  remove_child (p);
+	  link_process (p);
 	  type = "add (new parent)";
 	}
       else
@@ -629,14 +1227,16 @@ add_process (pid_t pid, pid_t ppid, double time, double memory, char* name)
   else
     {
       type = "add (new)";
-      p->new = 1;
       p->active = 1;
+      p->signalled = 0;
+      p->victim = 0;
       p->pid = pid;
       p->ppid = ppid;
       p->time = time;
       p->memory = memory;
+      p->smaps_sampled = -1;
       p->next_process = 0;
-      memcpy(p->name, name, 1000);
+      p->name = intern_name (name);
       if (last_active_process)
 	last_active_process->next_process = p;
       else
@@ -646,114 +1246,429 @@ add_process (pid_t pid, pid_t ppid, double time, double memory, char* name)
 	}
 
       last_active_process = p;
+
+      link_process (p);
     }
 
   /* debug (type, */
   /*   "%d (parent %d, %.3f sec, %.3f MB)", */
     /* pid, ppid, time, memory); */
 
-  p->sampled = num_samples;
+  p->sampled = num_reads;
+
+  return p;
 }
 
 /*------------------------------------------------------------------------*/
 
-#ifndef NDEBUG
-static int parsed;
-#endif
+/* Reading '/proc/<pid>/stat' is the hot path of sampling.  The whole
+ * line is read with a single 'pread' into a static buffer and then parsed
+ * in one pass without any further library calls or allocation.  For
+ * processes we keep track of, the file stays open between samples, which
+ * saves opening, closing and the path look-up.  Only half of the soft
+ * limit on open files is used for that purpose though.
+ */
 
-#define FAILED \
-do { \
-  fclose (file); \
-  return 0; \
-} while (0)
+static char stat_buffer[4096];
 
-#define READ(POS,TYPE,NAME,FMT) \
-  TYPE NAME; \
-  do { \
-    if (fscanf (file, FMT, &NAME) != 1) \
-      FAILED; \
-    assert (++parsed == (POS)); \
-  } while (0)
-
-#define IGNR(POS,TYPE,NAME,FMT) \
-  do { \
-    TYPE NAME; \
-    if (fscanf (file, FMT, &NAME) != 1) \
-      FAILED; \
-    (void) NAME; \
-    assert (++parsed == (POS)); \
-  } while (0)
-
-#define COMM(POS) \
-do { \
-  if (getc (file) != ' ') FAILED; \
-  if (getc (file) != '(') FAILED; \
-  int ch; \
-  int i = 0; \
-  while ((ch = getc (file)) != ')') { \
-    if (ch == EOF) FAILED; \
-    if (i < 1000) name[i++] = ch; \
-  } \
-  name[i] = '\0'; \
-  assert (++parsed == (POS)); \
-} while (0)
+static int
+parse_stat (char * start, char * end, Stat * s)
+{
+  unsigned long long value;
+  char * p, * close;
+  int pos, negative;
+
+  memset (s, 0, sizeof *s);
+
+  /* The command name may contain spaces and parentheses, thus the last
+   * closing parenthesis terminates it.
+   */
+  for (close = end; close > start && close[-1] != ')'; close--)
+    ;
+  if (close == start)
+    return 0;
+  close--;
+
+  value = 0;
+  for (p = start; p < close && isdigit ((unsigned char) *p); p++)
+    value = 10*value + (*p - '0');
+  if (p == start || p + 2 > close || p[0] != ' ' || p[1] != '(')
+    return 0;
+
+  s->field[PID_POS] = value;
+  s->comm = p + 2;
+  *close = 0;
+
+  p = close + 1;
+  if (p + 2 >= end || p[0] != ' ')
+    return 0;
+  s->state = p[1];
+  p += 2;
+
+  for (pos = STATE_POS + 1; pos <= MAX_POS; pos++)
+    {
+      if (p == end || *p != ' ')
+	break;
+      p++;
+      negative = (p < end && *p == '-');
+      if (negative)
+	p++;
+      if (p == end || !isdigit ((unsigned char) *p))
+	return 0;
+      value = 0;
+      do
+	value = 10*value + (*p++ - '0');
+      while (p < end && isdigit ((unsigned char) *p));
+      s->field[pos] = negative ? -(long long) value : (long long) value;
+    }
+
+  if (pos <= RSS_POS)
+    return 0;
+
+  s->fields = pos - 1;
+
+  return 1;
+}
 
 static int
-read_process (long pid)
+read_stat (int fd, Stat * s)
 {
-  char path[64];
-  FILE *file;
-  sprintf (path, "/proc/%ld/stat", pid);
+  ssize_t bytes;
+  char * end;
+
+  bytes = pread (fd, stat_buffer, sizeof stat_buffer, 0);
+  if (bytes <= 0 || bytes == sizeof stat_buffer)
+    return 0;
+
+  end = stat_buffer + bytes;
+  if (end[-1] == '\n')
+    end--;
+
+  return parse_stat (stat_buffer, end, s);
+}
+
+static long stat_fds;
+static long max_stat_fds;
+
+static void
+get_max_stat_fds (void)
+{
+  struct rlimit rlim;
+  if (getrlimit (RLIMIT_NOFILE, &rlim) || rlim.rlim_cur == RLIM_INFINITY)
+    max_stat_fds = 512;
+  else
+    max_stat_fds = rlim.rlim_cur / 2;
+  debug ("stat files", "keeping at most %ld open", max_stat_fds);
+}
+
+static void
+close_stat_fd (Process * p)
+{
+  if (p->stat_fd < 0)
+    return;
+  (void) close (p->stat_fd);
+  p->stat_fd = -1;
+  assert (stat_fds > 0);
+  stat_fds--;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* Resident set sizes count pages shared between processes, for instance
+ * after 'fork', once for every process.  With '--memory-metric=pss' the
+ * proportional set size (shared pages split among sharing processes) and
+ * with '--memory-metric=uss' the unique set size (private pages only) from
+ * '/proc/<pid>/smaps_rollup' is used instead.  Reading it is expensive,
+ * since the kernel walks all page tables of the process.  Thus it is only
+ * read every '--smaps-rate' samples or if the resident set size changed
+ * by more than an eighth since the last read.  In between the last value
+ * is adjusted by the change of the resident set size.
+ */
+
+#define RSS_METRIC 0
+#define PSS_METRIC 1
+#define USS_METRIC 2
+
+static const char * memory_metric_names[] = { "rss", "pss", "uss" };
+
+static int memory_metric = RSS_METRIC;
+static long smaps_rate = SMAPS_RATE;
+static long smaps_reads;
+
+static int
+read_smaps_rollup (long pid, double * memory_ptr)
+{
+  double pss, private_clean, private_dirty;
+  char path[64], line[256];
+  unsigned long kb;
+  FILE * file;
+
+  sprintf (path, "/proc/%ld/smaps_rollup", pid);
   file = fopen (path, "r");
   if (!file)
     return 0;
-#ifndef NDEBUG
-  parsed = 0;
-#endif
-  READ (1, int, rid, "%d");
-  if (rid != pid) FAILED;
-  char name[1000];
-  COMM (2);
-  if (getc (file) != ' ')
-    FAILED;
-  IGNR (3, char, state, "%c");
-  READ (4, int, ppid, "%d");
-  READ (5, int, pgrp, "%d");
-  READ (6, int, session, "%d");
+
+  pss = private_clean = private_dirty = 0;
+  while (fgets (line, sizeof line, file))
+    if (sscanf (line, "Pss: %lu kB", &kb) == 1)
+      pss = kb / 1024.0;
+    else if (sscanf (line, "Private_Clean: %lu kB", &kb) == 1)
+      private_clean = kb / 1024.0;
+    else if (sscanf (line, "Private_Dirty: %lu kB", &kb) == 1)
+      private_dirty = kb / 1024.0;
+
+  (void) fclose (file);
+
+  smaps_reads++;
+
+  if (memory_metric == PSS_METRIC)
+    *memory_ptr = pss;
+  else
+    *memory_ptr = private_clean + private_dirty;
+
+  return 1;
+}
+
+static double
+smaps_memory (Process * p, long pid, double rss)
+{
+  double memory, delta;
+
+  delta = rss - p->smaps_rss;
+
+  if (p->smaps_sampled < 0 ||
+      num_samples - p->smaps_sampled >= smaps_rate ||
+      8 * delta > p->smaps_rss || -8 * delta > p->smaps_rss)
+    {
+      if (read_smaps_rollup (pid, &memory))
+	{
+	  p->smaps_sampled = num_samples;
+	  p->smaps_rss = rss;
+	  p->smaps_memory = memory;
+	  return memory;
+	}
+      if (p->smaps_sampled < 0)
+	return rss;
+    }
+
+  memory = p->smaps_memory + delta;
+  if (memory < 0)
+    memory = 0;
+  if (memory > rss)
+    memory = rss;
+
+  return memory;
+}
+
+static void
+check_smaps_rollup (void)
+{
+  double memory;
+
+  if (memory_metric == RSS_METRIC)
+    return;
+
+  if (!read_smaps_rollup ((long) getpid (), &memory))
+    error ("can not read '/proc/self/smaps_rollup' for '--memory-metric'");
+}
+
+/*------------------------------------------------------------------------*/
+
+/* With '--io' the counters in '/proc/<pid>/io' are read for every process.
+ * They include the counters of all children the process waited for.  Thus
+ * the sum over all live processes plus the final counters of processes
+ * waited for by runlim itself (the child process and adopted orphans)
+ * gives the I/O of the whole tree without counting terminated processes
+ * twice.  The latter are read while the process is still a zombie (see
+ * 'wait_for_process').  Bytes are those read from and written to storage
+ * ('read_bytes' and 'write_bytes') and calls are 'syscr' and 'syscw'.
+ */
+
+static const char * io_keys[NUM_IO] = {
+  "\nread_bytes: ", "\nwrite_bytes: ", "\nsyscr: ", "\nsyscw: "
+};
+
+static int io_accounting;
+static double write_limit;		/* in MB */
+static double write_rate_limit;		/* in MB per second */
+static int write_rate_throttled;	/* by the cgroup */
+
+static double sampled_io[NUM_IO];
+static double reaped_io[NUM_IO];
+static double max_io[NUM_IO];
+
+static double write_rate_window_start = -1;
+static double write_rate_window_bytes;
+static double write_rate;		/* of last complete window */
+static double max_write_rate;
+
+static volatile int caught_out_of_io;
+
+static int
+read_io (long pid, double * io)
+{
+  char path[64], buffer[512];
+  ssize_t bytes;
+  char * p;
+  int fd, i;
+
+  sprintf (path, "/proc/%ld/io", pid);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  bytes = read (fd, buffer, sizeof buffer - 1);
+  (void) close (fd);
+  if (bytes <= 0)
+    return 0;
+  buffer[bytes] = 0;
+
+  for (i = 0; i < NUM_IO; i++)
+    {
+      p = strstr (buffer, io_keys[i]);
+      if (!p)
+	return 0;
+      io[i] = strtod (p + strlen (io_keys[i]), 0);
+    }
+
+  return 1;
+}
+
+/* Called with the process table locked, before the zombie is reaped.
+ */
+static void
+add_reaped_io (pid_t pid)
+{
+  double io[NUM_IO];
+  int i;
+
+  if (!read_io (pid, io))
+    return;
+
+  for (i = 0; i < NUM_IO; i++)
+    reaped_io[i] += io[i];
+}
+
+/* The write rate is the average over complete windows of at least
+ * 'WRITE_RATE_WINDOW' seconds.
+ */
+static void
+sample_io (double real)
+{
+  double written;
+  int i;
+
+  for (i = 0; i < NUM_IO; i++)
+    {
+      sampled_io[i] += reaped_io[i];
+      if (sampled_io[i] > max_io[i])
+	max_io[i] = sampled_io[i];
+    }
+
+  written = sampled_io[WRITE_BYTES_IO] / (1<<20);
+  if (write_rate_window_start < 0)
+    {
+      write_rate_window_start = real;
+      write_rate_window_bytes = written;
+    }
+  else if (real - write_rate_window_start >= WRITE_RATE_WINDOW)
+    {
+      write_rate = (written - write_rate_window_bytes) /
+                   (real - write_rate_window_start);
+      if (write_rate > max_write_rate)
+	max_write_rate = write_rate;
+      write_rate_window_start = real;
+      write_rate_window_bytes = written;
+    }
+}
+
+static int
+io_limit_exceeded (void)
+{
+  if (write_limit && sampled_io[WRITE_BYTES_IO] > write_limit * (1<<20))
+    return 1;
+  if (write_rate_limit && !write_rate_throttled &&
+      write_rate > write_rate_limit)
+    return 1;
+  return 0;
+}
+
+/* Processes are either found by scanning all of '/proc' and filtering
+ * them by process group and session, or, if 'descendant' is set, are
+ * known to be descendants of the child process and thus are not filtered.
+ */
+
+static int
+read_process (long pid, int descendant)
+{
+  long long ppid, pgrp, session, utime, stime, rss;
+  char path[64];
+  Process * p;
+  Stat s;
+  int fd;
+
+  p = find_existing_process (pid);
+  if (p && p->active && p->stat_fd >= 0)
+    {
+      fd = p->stat_fd;
+      if (!read_stat (fd, &s) || s.field[PID_POS] != pid)
+	{
+	  close_stat_fd (p);
+	  fd = -1;
+	}
+    }
+  else
+    fd = -1;
+
+  if (fd < 0)
+    {
+      sprintf (path, "/proc/%ld/stat", pid);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+	return 0;
+      if (!read_stat (fd, &s) || s.field[PID_POS] != pid)
+	{
+	  (void) close (fd);
+	  return 0;
+	}
+    }
+
+  ppid = s.field[PPID_POS];
+  pgrp = s.field[PGID_POS];
+  session = s.field[SESSION_POS];
   /* debug ("read", "pid=%d ppid=%d pgrp=%d session=%d", pid, ppid, pgrp, session); */
-  if (pgrp != pid && pgrp != parent_pid &&
-      pgrp != group_pid && session != session_pid)
-    FAILED;
-  IGNR (7, int, tty_nr, "%d");
-  IGNR (8, int, tpgid, "%d");
-  IGNR (9, unsigned int, flags, "%u");
-  IGNR (10, unsigned long, minflt, "%lu");
-  IGNR (11, unsigned long, cminflt, "%lu");
-  IGNR (12, unsigned long, majflt, "%lu");
-  IGNR (13, unsigned long, cmajflt, "%lu");
-  READ (14, unsigned long, utime, "%lu");
-  if (utime < 0)
-    FAILED;
-  READ (15, unsigned long, stime, "%lu");
-  if (stime < 0)
-    FAILED;
-  IGNR (16, long, cutime, "%ld");
-  IGNR (17, long, cstime, "%ld");
-  IGNR (18, long, priority, "%ld");
-  IGNR (19, long, nice, "%ld");
-  IGNR (20, long, num_threads, "%ld");
-  IGNR (21, long, itrealvalue, "%ld");
-  IGNR (22, unsigned long long, starttime, "%llu");
-  IGNR (23, unsigned long, vsize, "%lu");
-  READ (24, long, rss, "%ld");
-  if (rss < 0)
-    FAILED;
-  fclose (file);
+  if ((!descendant &&
+       pgrp != pid && pgrp != parent_pid &&
+       pgrp != group_pid && session != session_pid) ||
+      ppid < 0 ||
+      (utime = s.field[UTIME_POS]) < 0 ||
+      (stime = s.field[STIME_POS]) < 0 ||
+      (rss = s.field[RSS_POS]) < 0)
+    {
+      if (!p || fd != p->stat_fd)
+	(void) close (fd);
+      return 0;
+    }
+
   /* debug ("utime", "%f microseconds", utime); */
   /* debug ("stime", "%f microseconds", stime); */
   const double time = (utime + stime) / (double) clock_ticks;
   const double memory = rss * memory_per_page;
-  add_process (pid, ppid, time, memory, name);
+  p = add_process (pid, ppid, time, memory, s.comm);
+  p->zombie = (s.state == 'Z');
+  if (memory_metric != RSS_METRIC && !p->zombie)
+    p->memory = smaps_memory (p, pid, memory);
+  if (io_accounting)
+    (void) read_io (pid, p->io);
+  if (p->stat_fd != fd)
+    {
+      if (p->stat_fd < 0 && stat_fds < max_stat_fds)
+	{
+	  p->stat_fd = fd;
+	  stat_fds++;
+	}
+      else
+	(void) close (fd);
+    }
   return 1;
 }
 
@@ -798,7 +1713,7 @@ read_all_processes (void)
       if (!is_positive_long (de->d_name, &pid)) continue;
       if (pid <= 0) continue;
       if (pid == parent_pid) continue;
-      if (read_process (pid)) res++;
+      if (read_process (pid, 0)) res++;
     }
 
   (void) closedir (dir);
@@ -807,467 +1722,4002 @@ read_all_processes (void)
   return res;
 }
 
-static long
-read_processes (void) {
-  if (single) return read_process (child_pid);
-  else return read_all_processes ();
-}
+/*------------------------------------------------------------------------*/
 
-static void
-clear_tree_connections (Process * p)
-{
-  p->parent = p->first_child = p->last_child = p->next_sibbling = 0;
-}
+/* Instead of scanning all of '/proc' we can follow the 'children' files of
+ * all threads starting at the runlim process itself.  This makes reading
+ * processes linear in the number of descendants instead of the number of
+ * processes on the system.  Since runlim then is a child subreaper,
+ * orphaned descendants are reparented to runlim and are found this way
+ * too.  The 'children' files require 'CONFIG_PROC_CHILDREN' and if they
+ * are missing we fall back to scanning all processes.
+ */
+
+static int children_files_missing;
+static int only_untracked_children;
+
+static long * descendants_queue;
+static size_t size_descendants_queue;
+static size_t num_descendants_queue;
 
 static void
-connect_process_tree (void)
+push_descendant (long pid)
 {
-  Process * p, * parent;
-  long connected = 0;
-
-  for (p = active_processes; p; p = p->next_process)
+  if (num_descendants_queue == size_descendants_queue)
     {
-      assert (p->active);
-      assert (find_process (p->pid) == p);
-      parent = find_process (p->ppid);
-      clear_tree_connections (parent);
-      clear_tree_connections (p);
+      size_descendants_queue =
+        size_descendants_queue ? 2*size_descendants_queue : 64;
+      descendants_queue = realloc (descendants_queue,
+        size_descendants_queue * sizeof *descendants_queue);
+      if (!descendants_queue)
+	error ("out-of-memory reallocating descendants queue");
     }
+  descendants_queue[num_descendants_queue++] = pid;
+}
 
-  for (p = active_processes; p; p = p->next_process)
-    {
-      if (p->pid == child_pid) continue;
-      assert (p->pid != parent_pid);
-      parent = find_process (p->ppid);
-      p->parent = parent;
-      if (parent->first_child) {
-	assert (parent->last_child);
-	assert (!parent->last_child->next_sibbling);
-	parent->last_child->next_sibbling = p;
-	parent->last_child = p;
-	assert (!p->next_sibbling);
-      } else {
-	assert (!parent->last_child);
-        parent->first_child = parent->last_child = p;
-	assert (!p->next_sibbling);
-      }
-      /* debug ("connect", "%d -> %d", p->ppid, p->pid); */
-      connected++;
-    }
+static long
+read_child (long pid)
+{
+  Process * p;
 
-  /* debug ("connected", "%ld processes", connected); */
-}
+  if (only_untracked_children &&
+      (p = find_existing_process (pid)) && p->active)
+    return 0;
 
-/*------------------------------------------------------------------------*/
+  if (!read_process (pid, 1))
+    return 0;
 
-static double accumulated_time;
+  push_descendant (pid);
 
-/*------------------------------------------------------------------------*/
+  return 1;
+}
 
 static long
-flush_inactive_processes (void)
+read_children_of_task (long pid, long tid)
 {
-  Process * prev = 0;
-  Process * next;
-  long res = 0;
-  Process * p;
-
-  for (p = active_processes; p; p = next)
+  char path[64], chunk[512];
+  ssize_t bytes, i;
+  long child, res;
+  int fd, digits;
+
+  sprintf (path, "/proc/%ld/task/%ld/children", pid, tid);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
     {
-      assert (p->active);
-
-      next = p->next_process;
+      if (errno == ENOENT && pid == parent_pid)
+	children_files_missing = 1;
+      return 0;
+    }
 
-      if (p->sampled == num_samples)
+  res = child = digits = 0;
+  while ((bytes = read (fd, chunk, sizeof chunk)) > 0)
+    for (i = 0; i < bytes; i++)
+      if (isdigit ((unsigned char) chunk[i]))
 	{
-	  prev = p;
+	  child = 10*child + (chunk[i] - '0');
+	  digits = 1;
 	}
-      else
+      else if (digits)
 	{
-	  p->active = 0;
-
-	  if (prev)
-	    prev->next_process = next;
-	  else
-	    active_processes = next;
-
-	  debug ("deactive", "%d (%.3f sec)", p->pid, p->time);
-	  accumulated_time += p->time;
-	  p->next_process = 0;
-	  res++;
+	  res += read_child (child);
+	  child = digits = 0;
 	}
-    }
 
-  last_active_process = prev;
+  if (digits)
+    res += read_child (child);
 
-  /* debug ("flushed", "%ld processes", res); */
+  (void) close (fd);
 
   return res;
 }
 
-/*------------------------------------------------------------------------*/
+static long
+read_children (long pid)
+{
+  struct dirent * de;
+  char path[64];
+  long tid, res;
+  DIR * dir;
 
-static double sampled_time;
-static double sampled_memory;
+  sprintf (path, "/proc/%ld/task", pid);
+  dir = opendir (path);
+  if (!dir)
+    return 0;
 
-/*------------------------------------------------------------------------*/
-int toprint = 0;
+  res = 0;
+  while (!children_files_missing && (de = readdir (dir)))
+    if (is_positive_long (de->d_name, &tid) && tid > 0)
+      res += read_children_of_task (pid, tid);
+
+  (void) closedir (dir);
+
+  return res;
+}
 
 static long
-sample_recursively (Process * p)
+read_descendants (void)
 {
-  const char * type;
-  Process * child;
-  long res = 0;
+  size_t i;
+  long res;
 
-  if (p->cyclic_sampling)
-    {
-      warning ("cyclic process dependencies during sampling");
-      return 0;
-    }
+  read_parent_status_and_mount_proc_file_system_if_necessary ();
 
-  if (p->sampled == num_samples)
-    {
-      if (p->new)
-	{
-	  children++;
-	  type = "sampling (new)";
-	}
-      else
-	type = "sampling";
+  num_descendants_queue = 0;
+  res = read_children (parent_pid);
 
-      sampled_time += p->time;
-      sampled_memory += p->memory;
+  for (i = 0; !children_files_missing && i < num_descendants_queue; i++)
+    res += read_children (descendants_queue[i]);
 
-      res++;
-      if (toprint % 30 == 0) debug (type, "%d (%s, %.3f sec, %.3f MB)", p->pid, p->name, p->time, p->memory);
+  if (children_files_missing)
+    {
+      warning ("no 'children' files in '/proc' (scanning all processes)");
+      descendants = 0;
+      res = read_all_processes ();
     }
 
-  p->cyclic_sampling = 1;
-
-  for (child = p->first_child; child; child = child->next_sibbling)
-    res += sample_recursively (child);
-
-  assert (p->cyclic_sampling);
-  p->cyclic_sampling = 0;
-
   return res;
 }
 
 /*------------------------------------------------------------------------*/
 
-static struct itimerval timer;
-static struct itimerval old_timer;
-
-static volatile int caught_out_of_memory;
-static volatile int caught_out_of_time;
+/* With '--process-events' runlim subscribes to fork, exec and exit events
+ * of the kernel process connector.  A separate thread reads forked
+ * descendants as soon as they are created and reads the final state of
+ * processes when they exit.  Thus even processes which live shorter than
+ * the sampling interval are accounted for, and sampling only has to
+ * re-read the tracked processes instead of scanning '/proc'.  Subscribing
+ * requires 'CAP_NET_ADMIN' and otherwise we fall back to polling.  If the
+ * kernel had to drop events, the next sample scans all processes again.
+ */
+
+static int process_events_fd = -1;
+static pthread_t process_events_thread;
+static int watching_process_events;
+static volatile int rescan_processes = 1;
 
-/*------------------------------------------------------------------------*/
+static int
+send_process_events_operation (enum proc_cn_mcast_op op)
+{
+  char buf[NLMSG_SPACE (sizeof (struct cn_msg) + sizeof op)];
+  struct nlmsghdr * header;
+  struct cn_msg * msg;
+
+  memset (buf, 0, sizeof buf);
+  header = (struct nlmsghdr *) buf;
+  header->nlmsg_len = NLMSG_LENGTH (sizeof *msg + sizeof op);
+  header->nlmsg_type = NLMSG_DONE;
+  msg = NLMSG_DATA (header);
+  msg->id.idx = CN_IDX_PROC;
+  msg->id.val = CN_VAL_PROC;
+  msg->len = sizeof op;
+  memcpy (msg->data, &op, sizeof op);
+
+  return send (process_events_fd, header, header->nlmsg_len, 0) ==
+         (ssize_t) header->nlmsg_len;
+}
 
-static void
-term_process (Process * p)
+/* Returns the acknowledgement error of the listen operation or -1 if no
+ * acknowledgement was received.
+ */
+static int
+receive_process_events_acknowledgement (void)
 {
-  assert (p->pid != parent_pid);
-  debug ("kill with SIGTERM ", "%d", p->pid);
-  kill (p->pid, SIGTERM);
+  char buf[4096] __attribute__ ((aligned (NLMSG_ALIGNTO)));
+  struct proc_event * event;
+  struct nlmsghdr * header;
+  struct cn_msg * msg;
+  ssize_t bytes;
+
+  while ((bytes = recv (process_events_fd, buf, sizeof buf, 0)) > 0)
+    for (header = (struct nlmsghdr *) buf;
+         NLMSG_OK (header, bytes);
+	 header = NLMSG_NEXT (header, bytes))
+      {
+	msg = NLMSG_DATA (header);
+	event = (struct proc_event *) msg->data;
+	if (event->what == PROC_EVENT_NONE)
+	  return event->event_data.ack.err;
+      }
+
+  return -1;
 }
 
 static void
-kill_process (Process * p)
+close_process_events (void)
 {
-  assert (p->pid != parent_pid);
-  debug ("kill with SIGKILL ", "%d", p->pid);
-  kill (p->pid, SIGKILL);
+  (void) close (process_events_fd);
+  process_events_fd = -1;
+  process_events = 0;
 }
 
-static long
-kill_recursively (Process * p, void(*killer)(Process *))
+static void
+open_process_events (void)
 {
-  Process * child;
-  long res = 0;
+  struct timeval timeout = { 1, 0 };
+  struct sockaddr_nl addr;
+  int err;
 
-  if (p->cyclic_killing)
-    return 0;
+  process_events_fd =
+    socket (PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (process_events_fd < 0)
+    {
+      process_events = 0;
+      warning ("can not open process connector (polling instead)");
+      return;
+    }
 
-  p->cyclic_killing = 1;
-  for (child = p->first_child; child; child = child->next_sibbling)
-    res += kill_recursively (child, killer);
-  assert (p->cyclic_killing);
-  p->cyclic_killing = 0;
+  memset (&addr, 0, sizeof addr);
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
 
-  killer (p);
-  res++;
+  (void) setsockopt (process_events_fd,
+    SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
 
-  return res;
+  if (bind (process_events_fd, (struct sockaddr *) &addr, sizeof addr) ||
+      !send_process_events_operation (PROC_CN_MCAST_LISTEN))
+    err = errno;
+  else
+    err = receive_process_events_acknowledgement ();
+
+  if (err)
+    {
+      close_process_events ();
+      warning ("can not listen to process events (polling instead)");
+      return;
+    }
+
+  timeout.tv_sec = 0;
+  (void) setsockopt (process_events_fd,
+    SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+  debug ("process events", "listening");
 }
 
-static long kill_delay = KILL_DELAY;
+static int
+tracked_process (int pid, int ppid)
+{
+  Process * p;
+  if (ppid == parent_pid)
+    return pid == child_pid;
+  p = find_existing_process (ppid);
+  return p && p->active;
+}
 
 static void
-kill_all_child_processes (void)
+handle_process_event (struct proc_event * event)
 {
-  static void (*killer) (Process *);
-  long ms = kill_delay * 1000;
-  long rounds = 0;
-  Process * p;
-  long killed;
-  int ignore;
-  long read;
+  int pid, ppid;
 
-  assert (getpid () == parent_pid);
+  switch (event->what)
+    {
+    case PROC_EVENT_FORK:
+      pid = event->event_data.fork.child_pid;
+      if (pid != event->event_data.fork.child_tgid)
+	break;
+      ppid = event->event_data.fork.parent_tgid;
+      if (tracked_process (pid, ppid))
+	(void) read_process (pid, 1);
+      break;
 
-  pthread_mutex_lock (&mutex);
-  if (!(ignore = killing)) killing = 1;
-  pthread_mutex_unlock (&mutex);
-  if (ignore) return;
+    case PROC_EVENT_EXEC:
+      pid = event->event_data.exec.process_tgid;
+      if (tracked_process (pid, pid))
+	(void) read_process (pid, 1);
+      break;
 
-  debug ("killing", "all child processes");
+    case PROC_EVENT_EXIT:
+      pid = event->event_data.exit.process_pid;
+      if (pid != event->event_data.exit.process_tgid)
+	break;
+      if (tracked_process (pid, pid))
+	(void) read_process (pid, 1);
+      break;
 
-  for (;;)
-    {
-      if (ms >= 2000) killer = term_process;
-      else            killer = kill_process;
+    default:
+      break;
+    }
+}
 
-      read = read_processes ();
+static void *
+watch_process_events (void * dummy)
+{
+  char buf[8192] __attribute__ ((aligned (NLMSG_ALIGNTO)));
+  struct nlmsghdr * header;
+  struct cn_msg * msg;
+  ssize_t bytes;
 
-      killed = 0;
+  (void) dummy;
 
-      if (read > 0)
+  for (;;)
+    {
+      bytes = recv (process_events_fd, buf, sizeof buf, 0);
+      if (bytes < 0)
 	{
-	  connect_process_tree ();
-	  p = find_process (child_pid);
-	  if (p->active)
-	    killed = kill_recursively (p, killer);
+	  if (errno == ENOBUFS)
+	    rescan_processes = 1;
+	  else if (errno != EINTR)
+	    break;
+	  continue;
 	}
 
-      debug ("killed", "%ld processes", killed);
-
-      if (!killed) break;
-      if (ms <= 1000) break;
+      (void) pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, 0);
+      pthread_mutex_lock (&process_mutex);
 
-      rounds++;
+      for (header = (struct nlmsghdr *) buf;
+	   NLMSG_OK (header, bytes);
+	   header = NLMSG_NEXT (header, bytes))
+	{
+	  if (header->nlmsg_type != NLMSG_DONE)
+	    continue;
+	  msg = NLMSG_DATA (header);
+	  if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+	    continue;
+	  handle_process_event ((struct proc_event *) msg->data);
+	}
 
-      usleep (ms);
-      ms /= 2;
+      pthread_mutex_unlock (&process_mutex);
+      (void) pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, 0);
     }
-}
 
-/*------------------------------------------------------------------------*/
+  warning ("lost connection to process connector (polling instead)");
+  pthread_mutex_lock (&process_mutex);
+  process_events = 0;
+  pthread_mutex_unlock (&process_mutex);
 
-static double
-wall_clock_time (void)
-{
-  double res = -1;
-  struct timeval tv;
-  if (!gettimeofday(&tv, 0))
-    {
-      res = 1e-6 * tv.tv_usec;
-      res += tv.tv_sec;
-    }
-  return res;
+  return 0;
 }
 
-static double
-tai_time (void)
+/* Signals should be delivered to the main thread and not to the process
+ * events thread.
+ */
+static void
+start_watching_process_events (void)
 {
-  double res = -1;
-  struct timespec ts;
-  if (!clock_gettime(CLOCK_TAI, &ts))
+  sigset_t all, old;
+  (void) sigfillset (&all);
+  (void) pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&process_events_thread, 0, watch_process_events, 0))
     {
-      res = 1e-9 * ts.tv_nsec;
-      res += ts.tv_sec;
+      close_process_events ();
+      warning ("can not start process events thread (polling instead)");
     }
-  return res;
+  else
+    watching_process_events = 1;
+  (void) pthread_sigmask (SIG_SETMASK, &old, 0);
 }
 
-/*------------------------------------------------------------------------*/
+static void
+stop_watching_process_events (void)
+{
+  if (!watching_process_events)
+    return;
+  (void) pthread_cancel (process_events_thread);
+  (void) pthread_join (process_events_thread, 0);
+  watching_process_events = 0;
+  if (process_events_fd < 0)
+    return;
+  (void) send_process_events_operation (PROC_CN_MCAST_IGNORE);
+  close_process_events ();
+}
 
-static double
-real_time (void)
+/* The fork event of a process is missed if its parent has already been
+ * flushed when the event is handled.  The parent then terminated and the
+ * process has been adopted by runlim.  Thus untracked children of runlim
+ * and their descendants are read too.
+ */
+static long
+read_adopted_processes (void)
 {
-  double res;
-  if (start_time_tai < 0) return -1;
-  res = tai_time() - start_time_tai;
+  size_t i;
+  long res;
+
+  num_descendants_queue = 0;
+  only_untracked_children = 1;
+
+  res = read_children (parent_pid);
+  for (i = 0; !children_files_missing && i < num_descendants_queue; i++)
+    res += read_children (descendants_queue[i]);
+
+  only_untracked_children = 0;
+
   return res;
 }
 
-/*------------------------------------------------------------------------*/
-
-static void
-report (double time, double memory, double load)
+static long
+read_tracked_processes (void)
 {
-  double real = real_time ();
-  message ("sample", "%.2f time, %.2f real, %.0f MB, %.2f load",
-           time, real, memory, load);
-  num_reports++;
+  Process * p;
+  long res = 0;
+  for (p = active_processes; p; p = p->next_process)
+    if (read_process (p->pid, 1))
+      res++;
+  return res + read_adopted_processes ();
 }
 
 /*------------------------------------------------------------------------*/
 
-void print_process_tree (Process * p)
+/* With '--single' the time of the child is read from its process CPU-time
+ * clock, which has nanosecond resolution and needs a single system call,
+ * and the resident set size from '/proc/<pid>/statm'.  Only the first
+ * sample reads '/proc/<pid>/stat'.  CPU-time clocks of threads of other
+ * processes can not be read though, thus the per-thread breakdown printed
+ * with '--debug' uses '/proc/<pid>/task/<tid>/schedstat' (in nanoseconds)
+ * or, if missing, '/proc/<pid>/task/<tid>/stat' (in clock ticks).
+ */
+
+static clockid_t child_clock;
+static int child_clock_available;
+static int statm_fd = -1;
+
+static void
+open_child_clock (void)
 {
-  Process * c;
-  debug ("edge", "%d -> %d", p->ppid, p->pid);
-  for (c = p->first_child; c; c = c->next_sibbling)
-    print_process_tree (c);
+  char path[64];
+
+  child_clock_available = !clock_getcpuclockid (child_pid, &child_clock);
+  if (!child_clock_available)
+    {
+      warning ("can not get CPU-time clock of child (using '/proc')");
+      return;
+    }
+
+  sprintf (path, "/proc/%d/statm", child_pid);
+  statm_fd = open (path, O_RDONLY | O_CLOEXEC);
+
+  debug ("child clock", "%s", statm_fd < 0 ? "without 'statm'" : "opened");
 }
 
-/*------------------------------------------------------------------------*/
+static void
+close_child_clock (void)
+{
+  if (statm_fd >= 0)
+    (void) close (statm_fd);
+  statm_fd = -1;
+  child_clock_available = 0;
+}
 
-static double
-sample_load (void)
+static int
+read_statm_resident (long long * res_ptr)
 {
-  double load;
-  int res = getloadavg (&load, 1);
-  if (res != 1)
+  char buffer[256], * p;
+  long long res;
+  ssize_t bytes;
+
+  bytes = pread (statm_fd, buffer, sizeof buffer - 1, 0);
+  if (bytes <= 0)
     return 0;
-  if (load > max_load)
-    max_load = load;
-  return load;
-}
+  buffer[bytes] = 0;
 
-/*------------------------------------------------------------------------*/
+  for (p = buffer; isdigit ((unsigned char) *p); p++)
+    ;
+  if (*p++ != ' ' || !isdigit ((unsigned char) *p))
+    return 0;
+  for (res = 0; isdigit ((unsigned char) *p); p++)
+    res = 10*res + (*p - '0');
 
-static long sample_rate = SAMPLE_RATE;
-static long report_rate = REPORT_RATE;
+  *res_ptr = res;
 
-static void
-sample_all_child_processes (int s)
+  return 1;
+}
+
+static long
+read_single_process (void)
 {
-  long sampled, read;
-  double load;
+  long long resident;
+  struct timespec ts;
+  double memory;
   Process * p;
-  int ignore;
 
-  assert (s == SIGALRM);
-  assert (getpid () == parent_pid);
+  p = find_existing_process (child_pid);
+  if (!p || !p->active || statm_fd < 0)
+    return read_process (child_pid, 1);
 
-  pthread_mutex_lock (&mutex);
-  ignore = killing;
-  pthread_mutex_unlock (&mutex);
+  if (clock_gettime (child_clock, &ts) || !read_statm_resident (&resident))
+    return 0;
 
-  if (ignore) return;
+  memory = resident * memory_per_page;
+  if (memory_metric != RSS_METRIC)
+    memory = smaps_memory (p, child_pid, memory);
 
-  load = sample_load ();
+  p->time = ts.tv_sec + 1e-9 * ts.tv_nsec;
+  p->memory = memory;
+  p->sampled = num_reads;
+  if (io_accounting)
+    (void) read_io (child_pid, p->io);
 
-  num_samples++;
+  return 1;
+}
 
-  read = read_processes ();
-  connect_process_tree ();
+static void
+print_threads (void)
+{
+  char path[96], buffer[4096];
+  unsigned long long ns;
+  struct dirent * de;
+  ssize_t bytes;
+  double time;
+  long tid;
+  DIR * dir;
+  Stat s;
+  int fd;
 
-  sampled_time = sampled_memory = 0;
+  sprintf (path, "/proc/%d/task", child_pid);
+  dir = opendir (path);
+  if (!dir)
+    return;
 
-  if (read > 0)
+  while ((de = readdir (dir)))
     {
-  toprint++;
-      p = find_process (child_pid);
-      sampled = sample_recursively (p);
+      if (!is_positive_long (de->d_name, &tid) || tid <= 0)
+	continue;
+
+      sprintf (path, "/proc/%d/task/%ld/schedstat", child_pid, tid);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0)
+	{
+	  bytes = read (fd, buffer, sizeof buffer - 1);
+	  buffer[bytes > 0 ? bytes : 0] = 0;
+	  (void) close (fd);
+	  if (sscanf (buffer, "%llu", &ns) != 1)
+	    continue;
+	  time = 1e-9 * ns;
+	}
+      else
+	{
+	  sprintf (path, "/proc/%d/task/%ld/stat", child_pid, tid);
+	  fd = open (path, O_RDONLY | O_CLOEXEC);
+	  if (fd < 0)
+	    continue;
+	  if (!read_stat (fd, &s))
+	    {
+	      (void) close (fd);
+	      continue;
+	    }
+	  (void) close (fd);
+	  time = (s.field[UTIME_POS] + s.field[STIME_POS]) /
+	         (double) clock_ticks;
+	}
+
+      debug ("thread", "%ld (%.6f sec)", tid, time);
     }
-  else
-    sampled = 0;
 
-  /* debug ("sampled", "%ld processes", sampled); */
+  (void) closedir (dir);
+}
+
+/*------------------------------------------------------------------------*/
 
-  sampled += flush_inactive_processes ();
-  sampled_time += accumulated_time;
+static long
+read_processes (void) {
+  if (single) return read_single_process ();
+  if (process_events && !rescan_processes) return read_tracked_processes ();
+  rescan_processes = 0;
+  if (descendants) return read_descendants ();
+  else return read_all_processes ();
+}
 
-  if (sampled > 0)
-    {
-      if (sampled_memory > max_memory)
-	max_memory = sampled_memory;
 
-      if (sampled_time > max_time)
-	max_time = sampled_time;
-    }
+/*------------------------------------------------------------------------*/
 
-  if (++num_samples_since_last_report >= report_rate)
-    {
-      num_samples_since_last_report = 0;
-      if (sampled > 0)
-	{
-	  print_process_tree (find_process (child_pid));
-	  report (sampled_time, sampled_memory, load);
-	}
-    }
+/* The time of flushed processes is only known up to their last sample.
+ * Processes terminating between samples or living shorter than a sample
+ * period are thus not accounted for (or only partially).  However, if
+ * runlim is a child subreaper, all descendants are eventually waited for,
+ * either by their parent or by runlim.  Their exact time then shows up in
+ * 'RUSAGE_CHILDREN' of runlim, through the child process or adopted
+ * orphans.  This reaped time (minus the time of processes waited for
+ * before the child was started) is a lower bound on the time used in the
+ * tree while sampling, and after reaping all processes it is exact.
+ * Otherwise, i.e., without '--descendants' or '--process-events', orphans
+ * are waited for by 'init' instead, their time is missing and the reaped
+ * time is only a lower bound, also after reaping.
+ */
 
-  if (sampled > 0)
+static double accumulated_time;
+static double reaped_time_before_start;
+
+static double
+raw_reaped_time (void)
+{
+  struct rusage u;
+  if (getrusage (RUSAGE_CHILDREN, &u))
+    return 0;
+  return u.ru_utime.tv_sec + 1e-6 * u.ru_utime.tv_usec +
+         u.ru_stime.tv_sec + 1e-6 * u.ru_stime.tv_usec;
+}
+
+static double
+reaped_time (void)
+{
+  return raw_reaped_time () - reaped_time_before_start;
+}
+
+/*------------------------------------------------------------------------*/
+
+static long
+flush_inactive_processes (void)
+{
+  Process * prev = 0;
+  Process * next;
+  long res = 0;
+  Process * p;
+
+  for (p = active_processes; p; p = next)
     {
-      if (sampled_time > time_limit || real_time () > real_time_limit)
+      assert (p->active);
+
+      next = p->next_process;
+
+      if (p->sampled == num_reads)
 	{
-	  if (!caught_out_of_time)
-	    {
-	      caught_out_of_time = 1;
-	      kill_all_child_processes ();
-	    }
+	  prev = p;
 	}
-      else if (sampled_memory > space_limit)
+      else
 	{
-	  if (!caught_out_of_memory)
+	  p->active = 0;
+
+	  if (prev)
+	    prev->next_process = next;
+	  else
+	    active_processes = next;
+
+	  debug ("deactive", "%d (%.3f sec)", p->pid, p->time);
+	  close_stat_fd (p);
+	  if (p->descendant)
+	    accumulated_time += p->time;
+	  p->next_process = 0;
+	  res++;
+
+	  /* Adopted orphans are connected to the child process, which thus
+	   * has to stay in the table even after it terminated.
+	   */
+	  if (p->pid != child_pid)
 	    {
-	      caught_out_of_memory = 1;
-	      kill_all_child_processes ();
+	      unlink_process (p);
+	      delete_process (p);
 	    }
 	}
     }
+
+  last_active_process = prev;
+
+  /* debug ("flushed", "%ld processes", res); */
+
+  return res;
 }
 
 /*------------------------------------------------------------------------*/
 
-static volatile int caught_usr1_signal;
-static volatile int caught_other_signal;
+/* With '--cgroup' the child is put into a new cgroup v2 leaf which is
+ * created below the cgroup of runlim or the directory given as argument.
+ * Time and memory usage of all (even exited) processes in the tree are
+ * then read in constant time from 'cpu.stat' and 'memory.current'.  If the
+ * memory controller is not available for the leaf, memory is still
+ * sampled by reading processes, which is also done for debugging.
+ */
 
-static pthread_mutex_t caught_other_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int cgroup;
+static const char * cgroup_parent;
+static char * cgroup_path;
 
-/*------------------------------------------------------------------------*/
+static int kernel_space_limit;		/* see '--kernel-space-limit' */
+static double soft_space_limit;		/* see '--soft-space-limit' */
 
-static void
-sig_usr1_handler (int s)
+static int cgroup_cpu_stat_fd = -1;
+static int cgroup_memory_current_fd = -1;
+static int cgroup_memory_peak_fd = -1;
+
+static char *
+cgroup_file_path (const char * dir, const char * name)
 {
-  assert (s == SIGUSR1);
-  caught_usr1_signal = 1;
+  size_t len = strlen (dir) + strlen (name) + 2;
+  char * res = malloc (len);
+  if (!res)
+    error ("out-of-memory allocating cgroup path");
+  sprintf (res, "%s/%s", dir, name);
+  return res;
+}
+
+static int
+open_cgroup_file (const char * name, int flags)
+{
+  char * path = cgroup_file_path (cgroup_path, name);
+  int res = open (path, flags | O_CLOEXEC);
+  free (path);
+  return res;
+}
+
+static int
+write_cgroup_file (const char * dir, const char * name, const char * str)
+{
+  char * path = cgroup_file_path (dir, name);
+  int fd = open (path, O_WRONLY | O_CLOEXEC);
+  size_t len = strlen (str);
+  int res = fd >= 0 && write (fd, str, len) == (ssize_t) len;
+  if (fd >= 0)
+    (void) close (fd);
+  free (path);
+  return res;
 }
 
-static void (*old_sig_int_handler);
-static void (*old_sig_segv_handler);
-static void (*old_sig_kill_handler);
-static void (*old_sig_term_handler);
-static void (*old_sig_abrt_handler);
+/* Reads the number after 'key' in a flat keyed file, or the first number
+ * if 'key' is zero.
+ */
+static int
+read_cgroup_number (int fd, const char * key, double * res_ptr)
+{
+  char buf[1024], * p;
+  ssize_t bytes;
+  size_t len;
+
+  if (fd < 0)
+    return 0;
+
+  bytes = pread (fd, buf, sizeof buf - 1, 0);
+  if (bytes <= 0)
+    return 0;
+  buf[bytes] = 0;
+
+  p = buf;
+  if (key)
+    {
+      len = strlen (key);
+      for (;;)
+	{
+	  if (!strncmp (p, key, len) && p[len] == ' ')
+	    break;
+	  p = strchr (p, '\n');
+	  if (!p)
+	    return 0;
+	  p++;
+	}
+      p += len + 1;
+    }
+
+  if (!isdigit ((unsigned char) *p))
+    return 0;
+
+  *res_ptr = strtod (p, 0);
+
+  return 1;
+}
+
+static char *
+find_cgroup_mount_point (void)
+{
+  char * res = 0, * line = 0, * mount_point, * type;
+  size_t size = 0;
+  FILE * file;
+
+  file = fopen ("/proc/self/mountinfo", "r");
+  if (!file)
+    return 0;
+
+  while (!res && getline (&line, &size, file) > 0)
+    {
+      /* Fifth field is the mount point, the type follows the separator.
+       */
+      mount_point = line;
+      for (int i = 0; mount_point && i < 4; i++)
+	if ((mount_point = strchr (mount_point, ' ')))
+	  mount_point++;
+      type = strstr (line, " - cgroup2 ");
+      if (!mount_point || !type)
+	continue;
+      *strchr (mount_point, ' ') = 0;
+      res = strdup (mount_point);
+    }
+
+  free (line);
+  (void) fclose (file);
+
+  return res;
+}
+
+static char *
+find_own_cgroup (void)
+{
+  char * res = 0, * line = 0, * mount_point;
+  size_t size = 0, len;
+  FILE * file;
+
+  mount_point = find_cgroup_mount_point ();
+  if (!mount_point)
+    return 0;
+
+  file = fopen ("/proc/self/cgroup", "r");
+  if (file)
+    {
+      while (!res && getline (&line, &size, file) > 0)
+	{
+	  if (strncmp (line, "0::", 3))
+	    continue;
+	  len = strlen (line);
+	  if (len && line[len - 1] == '\n')
+	    line[--len] = 0;
+	  if (len <= 4)
+	    res = strdup (mount_point);
+	  else
+	    res = cgroup_file_path (mount_point, line + 4);
+	}
+      free (line);
+      (void) fclose (file);
+    }
+
+  free (mount_point);
+
+  return res;
+}
+
+static void
+create_cgroup (void)
+{
+  char * parent, name[64];
+  int enabled;
+
+  if (cgroup_parent)
+    parent = strdup (cgroup_parent);
+  else
+    parent = find_own_cgroup ();
+
+  if (!parent)
+    {
+      cgroup = 0;
+      warning ("no cgroup v2 hierarchy found (reading processes instead)");
+      return;
+    }
+
+  /* Controllers can not be enabled for children of a cgroup which contains
+   * processes (except for the root cgroup).  This holds in particular for
+   * the cgroup of runlim itself, thus 'parent' should be a delegated cgroup
+   * without processes given as '--cgroup=<dir>'.  Otherwise only the time
+   * is accounted in the cgroup.
+   */
+  enabled = write_cgroup_file (parent, "cgroup.subtree_control", "+cpu");
+  enabled &= write_cgroup_file (parent, "cgroup.subtree_control", "+memory");
+  if (write_rate_limit)
+    enabled &= write_cgroup_file (parent, "cgroup.subtree_control", "+io");
+  if (!enabled)
+    warning ("can not enable controllers in '%s' (not available or "
+             "not a delegated cgroup without processes)", parent);
+
+  sprintf (name, "runlim-%d", parent_pid);
+  cgroup_path = cgroup_file_path (parent, name);
+  free (parent);
+
+  if (mkdir (cgroup_path, 0755))
+    {
+      warning ("can not create cgroup '%s' (reading processes instead)",
+        cgroup_path);
+      free (cgroup_path);
+      cgroup_path = 0;
+      cgroup = 0;
+      return;
+    }
+
+  cgroup_cpu_stat_fd = open_cgroup_file ("cpu.stat", O_RDONLY);
+  cgroup_memory_current_fd = open_cgroup_file ("memory.current", O_RDONLY);
+  cgroup_memory_peak_fd = open_cgroup_file ("memory.peak", O_RDONLY);
+
+  debug ("cgroup", "%s", cgroup_path);
+  if (cgroup_memory_current_fd < 0)
+    debug ("cgroup", "no memory controller (reading processes instead)");
+}
+
+static void
+close_cgroup_file (int * fd_ptr)
+{
+  if (*fd_ptr < 0)
+    return;
+  (void) close (*fd_ptr);
+  *fd_ptr = -1;
+}
+
+static void
+remove_cgroup (void)
+{
+  int i;
+
+  if (!cgroup_path)
+    return;
+
+  close_cgroup_file (&cgroup_cpu_stat_fd);
+  close_cgroup_file (&cgroup_memory_current_fd);
+  close_cgroup_file (&cgroup_memory_peak_fd);
+
+  /* Killed processes might take a moment to leave the cgroup.
+   */
+  for (i = 0; rmdir (cgroup_path) && errno == EBUSY && i < 100; i++)
+    usleep (1000);
+
+  free (cgroup_path);
+  cgroup_path = 0;
+}
+
+/* Called by the parent after forking but before the child is released
+ * and starts executing the program.
+ */
+static void
+move_child_to_cgroup (void)
+{
+  char pid[32];
+
+  if (!cgroup_path)
+    return;
+
+  sprintf (pid, "%d", child_pid);
+  if (write_cgroup_file (cgroup_path, "cgroup.procs", pid))
+    return;
+
+  if (kernel_space_limit || soft_space_limit > 0)
+    {
+      (void) kill (child_pid, SIGKILL);
+      remove_cgroup ();
+      error ("can not move child to cgroup to enforce space limits");
+    }
+
+  warning ("can not move child to cgroup (reading processes instead)");
+  remove_cgroup ();
+  cgroup = 0;
+}
+
+static int
+cgroup_memory_available (void)
+{
+  return cgroup && cgroup_memory_current_fd >= 0;
+}
+
+/* The cgroup charges memory like the resident set size, thus with PSS or
+ * USS as memory metric memory is still sampled from the processes.
+ */
+static int
+cgroup_memory_sampled (void)
+{
+  return cgroup_memory_available () && memory_metric == RSS_METRIC;
+}
+
+static int
+sample_cgroup (double * time_ptr, double * memory_ptr)
+{
+  double usage, current;
+
+  if (!read_cgroup_number (cgroup_cpu_stat_fd, "usage_usec", &usage))
+    return 0;
+
+  *time_ptr = usage / 1e6;
+
+  if (cgroup_memory_sampled () &&
+      read_cgroup_number (cgroup_memory_current_fd, 0, &current))
+    *memory_ptr = current / (double)(1<<20);
+
+  return 1;
+}
+
+static int
+read_cgroup_peak_memory (void)
+{
+  double peak;
+  if (!read_cgroup_number (cgroup_memory_peak_fd, 0, &peak))
+    return 0;
+  max_memory = peak / (double)(1<<20);
+  return 1;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* With '--kernel-space-limit' the space limit is written to 'memory.max'
+ * of the cgroup leaf, thus the kernel enforces it immediately, instead of
+ * runlim noticing it at the next sample.  A separate thread waits for
+ * modifications of 'memory.events' and maps OOM kills in the cgroup to
+ * running out of memory.  The soft limit '--soft-space-limit' is written
+ * to 'memory.high' and makes the kernel throttle and reclaim instead.
+ */
+
+static int cgroup_memory_events_fd = -1;
+static pthread_t memory_events_thread;
+static int watching_memory_events;
+
+static volatile int caught_out_of_memory;
+
+static void kill_all_child_processes (void);
+
+/* The write rate limit is set in 'io.max' for all block devices backed by
+ * hardware, i.e., those with a 'device' link, which excludes 'loop', 'ram'
+ * and 'zram' devices.  Then the kernel throttles writes instead of runlim
+ * killing the processes, thus the write rate never ends the run.
+ */
+static void
+set_cgroup_write_rate_limit (void)
+{
+  char path[320], device[32], limit[96];
+  struct dirent * de;
+  long limited = 0, failed = 0;
+  struct stat st;
+  ssize_t bytes;
+  DIR * dir;
+  int fd;
+
+  if (!cgroup_path || !write_rate_limit)
+    return;
+
+  dir = opendir ("/sys/block");
+  if (!dir)
+    return;
+
+  while ((de = readdir (dir)))
+    {
+      if (de->d_name[0] == '.')
+	continue;
+      snprintf (path, sizeof path, "/sys/block/%s/device", de->d_name);
+      if (stat (path, &st))
+	continue;
+      snprintf (path, sizeof path, "/sys/block/%s/dev", de->d_name);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+	continue;
+      bytes = read (fd, device, sizeof device - 1);
+      (void) close (fd);
+      if (bytes <= 0)
+	continue;
+      device[bytes] = 0;
+      device[strcspn (device, "\n")] = 0;
+      sprintf (limit, "%s wbps=%.0f", device, write_rate_limit * (1<<20));
+      if (write_cgroup_file (cgroup_path, "io.max", limit))
+	limited++;
+      else
+	{
+	  debug ("io.max", "can not limit '%s'", de->d_name);
+	  failed++;
+	}
+    }
+  (void) closedir (dir);
+
+  if (limited)
+    {
+      write_rate_throttled = 1;
+      debug ("io.max", "%ld devices", limited);
+      if (failed)
+	warning ("can not set 'io.max' for %ld of %ld devices",
+	  failed, limited + failed);
+    }
+  else
+    warning ("can not set 'io.max' (write rate limit checked by sampling)");
+}
+
+static void
+set_cgroup_memory_limits (void)
+{
+  char bytes[32];
+
+  /* Unlike accounting these limits are explicitly requested and thus not
+   * silently replaced by sampling.
+   */
+  if (!cgroup_path)
+    error ("can not enforce space limits without cgroup");
+
+  if (!cgroup_memory_available ())
+    {
+      remove_cgroup ();
+      error ("can not enforce space limits without memory controller");
+    }
+
+  if (soft_space_limit > 0)
+    {
+      sprintf (bytes, "%.0f", soft_space_limit * (1<<20));
+      if (!write_cgroup_file (cgroup_path, "memory.high", bytes))
+	{
+	  remove_cgroup ();
+	  error ("can not set soft space limit");
+	}
+    }
+
+  if (!kernel_space_limit)
+    return;
+
+  sprintf (bytes, "%.0f", space_limit * (1<<20));
+  if (!write_cgroup_file (cgroup_path, "memory.max", bytes))
+    {
+      remove_cgroup ();
+      error ("can not set kernel space limit");
+    }
+
+  /* Avoid swapping instead of running out of memory and kill all
+   * processes in the cgroup at once instead of the largest one.
+   */
+  (void) write_cgroup_file (cgroup_path, "memory.swap.max", "0");
+  (void) write_cgroup_file (cgroup_path, "memory.oom.group", "1");
+
+  cgroup_memory_events_fd = open_cgroup_file ("memory.events", O_RDONLY);
+  if (cgroup_memory_events_fd < 0)
+    warning ("can not open 'memory.events' (space limit not reported)");
+}
+
+static int
+check_memory_events (void)
+{
+  double oom_kill;
+
+  if (!read_cgroup_number (cgroup_memory_events_fd, "oom_kill", &oom_kill) ||
+      !oom_kill)
+    return 0;
+
+  if (!caught_out_of_memory)
+    debug ("memory events", "%.0f OOM kills", oom_kill);
+
+  caught_out_of_memory = 1;
+
+  return 1;
+}
+
+static void *
+watch_memory_events (void * dummy)
+{
+  struct pollfd pfd;
+
+  (void) dummy;
+
+  pfd.fd = cgroup_memory_events_fd;
+  pfd.events = POLLPRI;
+
+  while (!caught_out_of_memory)
+    {
+      if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+	break;
+
+      (void) pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, 0);
+      if (check_memory_events ())
+	kill_all_child_processes ();
+      (void) pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, 0);
+    }
+
+  return 0;
+}
+
+static void
+start_watching_memory_events (void)
+{
+  sigset_t all, old;
+
+  if (cgroup_memory_events_fd < 0)
+    return;
+
+  (void) sigfillset (&all);
+  (void) pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&memory_events_thread, 0, watch_memory_events, 0))
+    warning ("can not start memory events thread");
+  else
+    watching_memory_events = 1;
+  (void) pthread_sigmask (SIG_SETMASK, &old, 0);
+}
+
+static void
+stop_watching_memory_events (void)
+{
+  if (watching_memory_events)
+    {
+      (void) pthread_cancel (memory_events_thread);
+      (void) pthread_join (memory_events_thread, 0);
+      watching_memory_events = 0;
+    }
+
+  if (cgroup_memory_events_fd < 0)
+    return;
+
+  (void) check_memory_events ();
+  close_cgroup_file (&cgroup_memory_events_fd);
+}
+
+/*------------------------------------------------------------------------*/
+
+static double sampled_time;
+static double sampled_memory;
+
+/*------------------------------------------------------------------------*/
+int toprint = 0;
+
+static long
+sample_descendants (void)
+{
+  long res = 0;
+  Process * p;
+  int i;
+
+  for (p = active_processes; p; p = p->next_process)
+    {
+      if (!p->descendant || p->sampled != num_reads)
+	continue;
+
+      sampled_time += p->time;
+      sampled_memory += p->memory;
+
+      if (io_accounting)
+	for (i = 0; i < NUM_IO; i++)
+	  sampled_io[i] += p->io[i];
+
+      res++;
+      if (toprint % 30 == 0) debug ("sampling", "%d (%s, %.3f sec, %.3f MB)", p->pid, p->name, p->time, p->memory);
+    }
+
+  return res;
+}
+
+/*------------------------------------------------------------------------*/
+
+static volatile int caught_out_of_time;
+
+/*------------------------------------------------------------------------*/
+
+static double
+wall_clock_time (void)
+{
+  double res = -1;
+  struct timeval tv;
+  if (!gettimeofday(&tv, 0))
+    {
+      res = 1e-6 * tv.tv_usec;
+      res += tv.tv_sec;
+    }
+  return res;
+}
+
+static double
+tai_time (void)
+{
+  double res = -1;
+  struct timespec ts;
+  if (!clock_gettime(CLOCK_TAI, &ts))
+    {
+      res = 1e-9 * ts.tv_nsec;
+      res += ts.tv_sec;
+    }
+  return res;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* Killing all child processes first sends 'SIGTERM' to all descendants
+ * and then waits for at most the kill delay until they all exited, before
+ * 'SIGKILL' is sent.  Descendants are tracked by process file descriptors
+ * ('pidfd'), which avoids signalling reused process identifiers and allows
+ * to poll for their termination, thus we return as soon as the last one
+ * terminated.  In between processes are read again to find new processes
+ * forked in the mean time.  With a cgroup leaf 'cgroup.kill' kills all
+ * processes in the cgroup atomically instead.
+ */
+
+static int kill_signal;
+
+static struct pollfd * victims;
+static size_t size_victims;
+static size_t num_victims;
+static size_t live_victims;
+static size_t victims_without_fd;
+
+static int
+open_process_fd (int pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  (void) pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int
+send_signal_to_process_fd (int fd, int sig)
+{
+#ifdef SYS_pidfd_send_signal
+  return syscall (SYS_pidfd_send_signal, fd, sig, 0, 0);
+#else
+  (void) fd, (void) sig;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void
+add_victim (Process * p)
+{
+  struct pollfd * v;
+
+  if (num_victims == size_victims)
+    {
+      size_victims = size_victims ? 2*size_victims : 16;
+      victims = realloc (victims, size_victims * sizeof *victims);
+      if (!victims)
+	error ("out-of-memory reallocating victims");
+    }
+
+  v = victims + num_victims++;
+  v->fd = open_process_fd (p->pid);
+  v->events = POLLIN;
+  v->revents = 0;
+
+  if (v->fd < 0)
+    victims_without_fd++;
+  else
+    live_victims++;
+
+  p->victim = num_victims;
+}
+
+static void
+signal_process (Process * p)
+{
+  struct pollfd * v;
+
+  assert (p->pid != parent_pid);
+
+  if (!p->victim)
+    add_victim (p);
+
+  v = victims + p->victim - 1;
+
+  debug (kill_signal == SIGTERM ?
+    "kill with SIGTERM " : "kill with SIGKILL ", "%d", p->pid);
+
+  if (v->fd < 0 || send_signal_to_process_fd (v->fd, kill_signal))
+    kill (p->pid, kill_signal);
+
+  p->signalled = kill_signal;
+}
+
+/* Returns the number of live descendants and signals those which have
+ * not been signalled with the current signal yet.
+ */
+static long
+kill_descendants (void)
+{
+  long res = 0;
+  Process * p;
+
+  for (p = active_processes; p; p = p->next_process)
+    {
+      if (!p->descendant || p->zombie)
+	continue;
+
+      if (p->signalled != kill_signal)
+	signal_process (p);
+
+      res++;
+    }
+
+  return res;
+}
+
+/* Waits until all victims terminated or the deadline passed.  Victims
+ * without process file descriptor can not be polled.  Then we only wait
+ * for a short slice, since only reading processes again shows whether
+ * they terminated.
+ */
+static void
+wait_for_victims (double deadline)
+{
+  double remaining;
+  int timeout, res;
+  size_t i;
+
+  for (;;)
+    {
+      if (!live_victims && !victims_without_fd)
+	return;
+      remaining = deadline - wall_clock_time ();
+      if (remaining <= 0)
+	return;
+      timeout = 1e3 * remaining + 1;
+      if (victims_without_fd && timeout > 10)
+	timeout = 10;
+      res = poll (victims, num_victims, timeout);
+      if (res < 0 && errno != EINTR)
+	return;
+      for (i = 0; res > 0 && i < num_victims; i++)
+	if (victims[i].fd >= 0 && victims[i].revents)
+	  {
+	    (void) close (victims[i].fd);
+	    victims[i].fd = -1;
+	    assert (live_victims > 0);
+	    live_victims--;
+	  }
+      if (victims_without_fd)
+	return;
+    }
+}
+
+/* Processes still refer to their victim entry, thus have to be reset too,
+ * in case processes are killed again.
+ */
+static void
+release_victims (void)
+{
+  Process * p;
+  size_t i;
+
+  pthread_mutex_lock (&process_mutex);
+  for (p = active_processes; p; p = p->next_process)
+    p->victim = p->signalled = 0;
+  pthread_mutex_unlock (&process_mutex);
+
+  for (i = 0; i < num_victims; i++)
+    if (victims[i].fd >= 0)
+      (void) close (victims[i].fd);
+
+  free (victims);
+  victims = 0;
+  size_victims = num_victims = live_victims = victims_without_fd = 0;
+}
+
+static int
+kill_cgroup (void)
+{
+  struct pollfd pfd;
+  double populated;
+  int i;
+
+  if (!cgroup_path || !write_cgroup_file (cgroup_path, "cgroup.kill", "1"))
+    return 0;
+
+  debug ("killing", "cgroup");
+
+  pfd.fd = open_cgroup_file ("cgroup.events", O_RDONLY);
+  pfd.events = POLLPRI;
+  for (i = 0; pfd.fd >= 0 && i < 10; i++)
+    {
+      if (read_cgroup_number (pfd.fd, "populated", &populated) && !populated)
+	break;
+      (void) poll (&pfd, 1, 100);
+    }
+  if (pfd.fd >= 0)
+    (void) close (pfd.fd);
+
+  return 1;
+}
+
+static long kill_delay = KILL_DELAY;
+
+static void
+kill_all_child_processes (void)
+{
+  double deadline;
+  long rounds, live;
+  int ignore;
+
+  assert (getpid () == parent_pid);
+
+  pthread_mutex_lock (&mutex);
+  if (!(ignore = killing)) killing = 1;
+  pthread_mutex_unlock (&mutex);
+  if (ignore) return;
+
+  debug ("killing", "all child processes");
+
+  kill_signal = SIGTERM;
+  deadline = wall_clock_time () + kill_delay / 1e3;
+
+  /* Only rounds after escalating to SIGKILL are counted.  Before that
+   * reading processes is bounded by the deadline.
+   */
+  rounds = 0;
+  while (rounds < 100)
+    {
+      pthread_mutex_lock (&process_mutex);
+
+      num_reads++;
+      (void) read_processes ();
+      (void) flush_inactive_processes ();
+      link_unlinked_processes ();
+
+      live = kill_descendants ();
+
+      pthread_mutex_unlock (&process_mutex);
+
+      debug ("killed", "%ld processes", live);
+
+      if (!live)
+	break;
+
+      if (kill_signal == SIGTERM)
+	{
+	  wait_for_victims (deadline);
+	  if (wall_clock_time () < deadline)
+	    continue;
+	  kill_signal = SIGKILL;
+	  if (kill_cgroup ())
+	    continue;
+	}
+      else
+	{
+	  wait_for_victims (wall_clock_time () + 0.1);
+	  rounds++;
+	}
+    }
+
+  release_victims ();
+
+  pthread_mutex_lock (&mutex);
+  killing = 0;
+  pthread_mutex_unlock (&mutex);
+}
+
+/*------------------------------------------------------------------------*/
+
+static double
+real_time (void)
+{
+  double res;
+  if (start_time_tai < 0) return -1;
+  res = tai_time() - start_time_tai;
+  return res;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* With '--perf' hardware performance counters are opened on the child while
+ * it waits on the start pipe.  They are enabled when the child executes the
+ * program, inherited by all its threads and processes forked afterwards,
+ * and only count user space, which is also allowed with the default
+ * 'perf_event_paranoid' of 2.  Reading an inherited counter sums up the
+ * counts of all its inherited copies, including those of processes which
+ * already terminated.  Counters which can not be opened, because the
+ * hardware does not provide them (as in many virtual machines) or they are
+ * not allowed, are skipped with a warning.
+ */
+
+#define INSTRUCTIONS_COUNTER 0
+#define CYCLES_COUNTER 1
+#define CACHE_MISSES_COUNTER 2
+#define BRANCH_MISSES_COUNTER 3
+#define NUM_COUNTERS 4
+
+static const char * counter_names[NUM_COUNTERS] = {
+  "instructions", "cycles", "cache misses", "branch misses"
+};
+
+static const unsigned long long counter_configs[NUM_COUNTERS] = {
+  PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static int perf_counters;
+static int counter_fds[NUM_COUNTERS] = { -1, -1, -1, -1 };
+static double counter_values[NUM_COUNTERS];
+
+/* With '--instruction-limit' the instructions counter overflows after the
+ * limit and the kernel then sends 'SIGIO' to the sampler thread, which
+ * wakes up and samples immediately.  Since inherited counters overflow
+ * individually, this only catches a single process exceeding the limit.
+ * The sum over all processes is checked in every sample.  The counter is
+ * pinned, so it is never multiplexed and thus its count never scaled.
+ */
+static long instruction_limit;
+static volatile int caught_instruction_overflow;
+static volatile int caught_out_of_instructions;
+
+static int
+open_counter (int i, pid_t pid)
+{
+  struct perf_event_attr attr;
+
+  memset (&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = counter_configs[i];
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  if (i == INSTRUCTIONS_COUNTER && instruction_limit)
+    {
+      attr.sample_period = instruction_limit;
+      attr.wakeup_events = 1;
+      attr.pinned = 1;
+    }
+
+  return syscall (SYS_perf_event_open, &attr, pid, -1, -1,
+                  PERF_FLAG_FD_CLOEXEC);
+}
+
+static void
+check_instruction_counter (void)
+{
+  int fd;
+
+  if (!instruction_limit)
+    return;
+
+  fd = open_counter (INSTRUCTIONS_COUNTER, 0);
+  if (fd < 0)
+    error ("can not open 'instructions' counter for '--instruction-limit'");
+  (void) close (fd);
+}
+
+static void
+open_performance_counters (void)
+{
+  int i, fd;
+
+  for (i = 0; i < NUM_COUNTERS; i++)
+    {
+      fd = open_counter (i, child_pid);
+      if (fd >= 0)
+	counter_fds[i] = fd;
+      else if (errno == EACCES || errno == EPERM)
+	warning ("no permission for '%s' counter "
+	         "(see '/proc/sys/kernel/perf_event_paranoid')",
+		 counter_names[i]);
+      else if (errno == ENOENT || errno == EOPNOTSUPP)
+	warning ("no hardware support for '%s' counter", counter_names[i]);
+      else
+	warning ("can not open '%s' counter", counter_names[i]);
+    }
+}
+
+/* If there are more counters than the hardware can count at once, the
+ * kernel multiplexes them and the counts are scaled up to the time the
+ * counter was enabled.  A pinned counter which can not be scheduled goes
+ * into an error state instead and reading it returns end-of-file.
+ */
+static void
+read_performance_counters (void)
+{
+  unsigned long long buffer[3];
+  ssize_t bytes;
+  int i;
+
+  for (i = 0; i < NUM_COUNTERS; i++)
+    {
+      if (counter_fds[i] < 0)
+	continue;
+      bytes = read (counter_fds[i], buffer, sizeof buffer);
+      if (!bytes && i == INSTRUCTIONS_COUNTER && instruction_limit)
+	{
+	  warning ("lost pinned 'instructions' counter "
+	           "(instruction limit not enforced anymore)");
+	  (void) close (counter_fds[i]);
+	  counter_fds[i] = -1;
+	}
+      if (bytes != sizeof buffer)
+	continue;
+      if (buffer[2] > 0 && buffer[2] < buffer[1])
+	counter_values[i] = buffer[0] * (double) buffer[1] / buffer[2];
+      else
+	counter_values[i] = buffer[0];
+    }
+}
+
+static void
+sig_io_handler (int s)
+{
+  assert (s == SIGIO);
+  caught_instruction_overflow = 1;
+}
+
+/* Called by the sampler thread, which thus receives the overflow signal.
+ */
+static void
+watch_instruction_overflow (void)
+{
+  struct f_owner_ex owner;
+  sigset_t io;
+  int fd;
+
+  fd = counter_fds[INSTRUCTIONS_COUNTER];
+  if (!instruction_limit || fd < 0)
+    return;
+
+  (void) sigemptyset (&io);
+  (void) sigaddset (&io, SIGIO);
+  (void) pthread_sigmask (SIG_UNBLOCK, &io, 0);
+
+  owner.type = F_OWNER_TID;
+  owner.pid = syscall (SYS_gettid);
+  if (fcntl (fd, F_SETOWN_EX, &owner) ||
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_ASYNC))
+    warning ("can not watch for instruction counter overflow");
+}
+
+static void
+close_performance_counters (void)
+{
+  int i;
+  for (i = 0; i < NUM_COUNTERS; i++)
+    if (counter_fds[i] >= 0)
+      {
+	(void) close (counter_fds[i]);
+	counter_fds[i] = -1;
+      }
+}
+
+static double
+instructions_per_cycle (double instructions, double cycles)
+{
+  return cycles > 0 ? instructions / cycles : 0;
+}
+
+static void
+print_performance_counters (void)
+{
+  int i;
+
+  for (i = 0; i < NUM_COUNTERS; i++)
+    if (counter_fds[i] >= 0)
+      message (counter_names[i], "%.0f", counter_values[i]);
+
+  if (counter_fds[INSTRUCTIONS_COUNTER] >= 0 &&
+      counter_fds[CYCLES_COUNTER] >= 0)
+    message ("IPC", "%.2f instructions per cycle",
+      instructions_per_cycle (counter_values[INSTRUCTIONS_COUNTER],
+                              counter_values[CYCLES_COUNTER]));
+}
+
+/*------------------------------------------------------------------------*/
+
+/* With '--scratch' the child gets a new scratch directory as 'TMPDIR',
+ * which is removed after the run.  Its size is tracked incrementally with
+ * 'inotify' instead of traversing the whole directory in every sample.
+ * All directories are watched and the allocated size of every entry is
+ * kept in a hash table indexed by watch descriptor and name.  Sizes of
+ * created and deleted entries are added and subtracted, while modified
+ * entries are only marked dirty and then 'lstat' is called once per
+ * sample for each of them.  Only if the event queue overflows the
+ * directory is traversed again.  Entries unlinked while still open are
+ * not counted (as with 'du').
+ */
+
+#define SCRATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | \
+                        IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static int scratch;
+static const char * scratch_parent;
+static char * scratch_path;
+static double disk_limit;		/* in MB */
+static int inotify_fd = -1;
+
+static char ** watched_directories;	/* indexed by watch descriptor */
+static int size_watched_directories;
+
+static Entry ** entries;
+static size_t size_entries;
+static size_t num_entries;
+static size_t deleted_entries;
+static Entry deleted_entry;
+
+static Entry ** dirty_entries;
+static size_t num_dirty_entries;
+static size_t size_dirty_entries;
+
+static double disk_usage;		/* in bytes */
+static double max_disk_usage;
+static long scratch_rescans;
+
+static volatile int caught_out_of_disk;
+
+static Entry **
+look_up_entry (int wd, const char * name)
+{
+  Entry ** res, ** deleted, * e;
+  size_t pos;
+
+  pos = (PRIME1 * (size_t) wd + hash_name (name)) & (size_entries - 1);
+  deleted = 0;
+
+  for (;;)
+    {
+      res = entries + pos;
+      e = *res;
+      if (!e)
+	return deleted ? deleted : res;
+      if (e == &deleted_entry)
+	{
+	  if (!deleted)
+	    deleted = res;
+	}
+      else if (e->wd == wd && !strcmp (e->name, name))
+	return res;
+      pos = (pos + PRIME2) & (size_entries - 1);
+    }
+}
+
+static void
+resize_entries (void)
+{
+  Entry ** old_entries = entries, * e;
+  size_t old_size = size_entries, pos;
+
+  size_entries = 16;
+  while (size_entries < 4 * (num_entries + 1))
+    size_entries *= 2;
+  deleted_entries = 0;
+
+  entries = calloc (size_entries, sizeof *entries);
+  if (!entries)
+    error ("out-of-memory resizing scratch entries");
+
+  for (pos = 0; pos < old_size; pos++)
+    if ((e = old_entries[pos]) && e != &deleted_entry)
+      *look_up_entry (e->wd, e->name) = e;
+  free (old_entries);
+}
+
+static void
+add_entry (int wd, const char * name, double bytes)
+{
+  Entry ** p, * e;
+
+  if (size_entries <= 2 * (num_entries + deleted_entries + 1))
+    resize_entries ();
+
+  p = look_up_entry (wd, name);
+  if ((e = *p) && e != &deleted_entry)
+    {
+      disk_usage += bytes - e->bytes;
+      e->bytes = bytes;
+      return;
+    }
+
+  if (e == &deleted_entry)
+    deleted_entries--;
+
+  e = malloc (sizeof *e + strlen (name) + 1);
+  if (!e)
+    error ("out-of-memory allocating scratch entry");
+  e->wd = wd;
+  e->dirty = 0;
+  e->bytes = bytes;
+  strcpy (e->name, name);
+  *p = e;
+  num_entries++;
+  disk_usage += bytes;
+}
+
+/* Dirty entries are released when the dirty entries are updated.
+ */
+static void
+remove_entry (int wd, const char * name)
+{
+  Entry ** p, * e;
+
+  if (!size_entries)
+    return;
+
+  p = look_up_entry (wd, name);
+  if (!(e = *p) || e == &deleted_entry)
+    return;
+
+  disk_usage -= e->bytes;
+  *p = &deleted_entry;
+  num_entries--;
+  deleted_entries++;
+
+  if (e->dirty)
+    e->wd = -1;
+  else
+    free (e);
+}
+
+static void
+mark_entry_dirty (int wd, const char * name)
+{
+  Entry ** p, * e;
+
+  if (!size_entries)
+    return;
+
+  p = look_up_entry (wd, name);
+  if (!(e = *p) || e == &deleted_entry || e->dirty)
+    return;
+
+  if (num_dirty_entries == size_dirty_entries)
+    {
+      size_dirty_entries = size_dirty_entries ? 2*size_dirty_entries : 64;
+      dirty_entries = realloc (dirty_entries,
+        size_dirty_entries * sizeof *dirty_entries);
+      if (!dirty_entries)
+	error ("out-of-memory reallocating dirty scratch entries");
+    }
+
+  e->dirty = 1;
+  dirty_entries[num_dirty_entries++] = e;
+}
+
+static int
+allocated_bytes (const char * path, struct stat * st, double * bytes_ptr)
+{
+  if (lstat (path, st))
+    return 0;
+  *bytes_ptr = 512.0 * st->st_blocks;
+  return 1;
+}
+
+static void watch_directory (const char *);
+
+/* Adds the entry 'name' in the directory watched by 'wd' and watches it
+ * too if it is a directory.
+ */
+static void
+add_scratch_entry (int wd, const char * name)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  double bytes;
+
+  if (wd < 0 || wd >= size_watched_directories || !watched_directories[wd])
+    return;
+
+  snprintf (path, sizeof path, "%s/%s", watched_directories[wd], name);
+  if (!allocated_bytes (path, &st, &bytes))
+    return;
+
+  add_entry (wd, name, bytes);
+  if (S_ISDIR (st.st_mode))
+    watch_directory (path);
+}
+
+/* Entries created before the watch was added are found by reading the
+ * directory afterwards, which might add entries twice, but 'add_entry'
+ * then only updates the size.
+ */
+static void
+watch_directory (const char * path)
+{
+  struct dirent * de;
+  int wd, old_size;
+  DIR * dir;
+
+  wd = inotify_add_watch (inotify_fd, path, SCRATCH_EVENTS);
+  if (wd < 0)
+    {
+      warning ("can not watch scratch directory '%s'", path);
+      return;
+    }
+
+  if (wd >= size_watched_directories)
+    {
+      old_size = size_watched_directories;
+      while (wd >= size_watched_directories)
+	size_watched_directories =
+	  size_watched_directories ? 2*size_watched_directories : 16;
+      watched_directories = realloc (watched_directories,
+        size_watched_directories * sizeof *watched_directories);
+      if (!watched_directories)
+	error ("out-of-memory reallocating watched directories");
+      memset (watched_directories + old_size, 0,
+        (size_watched_directories - old_size) *
+	sizeof *watched_directories);
+    }
+
+  free (watched_directories[wd]);
+  watched_directories[wd] = strdup (path);
+  if (!watched_directories[wd])
+    error ("out-of-memory copying scratch directory path");
+
+  dir = opendir (path);
+  if (!dir)
+    return;
+  while ((de = readdir (dir)))
+    if (strcmp (de->d_name, ".") && strcmp (de->d_name, ".."))
+      add_scratch_entry (wd, de->d_name);
+  (void) closedir (dir);
+}
+
+static void
+release_scratch_entries (void)
+{
+  size_t pos;
+
+  /* Removed dirty entries are not in the table anymore and all others
+   * are, thus the dirty entries have to be released first.
+   */
+  for (pos = 0; pos < num_dirty_entries; pos++)
+    if (dirty_entries[pos]->wd < 0)
+      free (dirty_entries[pos]);
+  free (dirty_entries);
+  dirty_entries = 0;
+  num_dirty_entries = size_dirty_entries = 0;
+
+  for (pos = 0; pos < size_entries; pos++)
+    if (entries[pos] && entries[pos] != &deleted_entry)
+      free (entries[pos]);
+  free (entries);
+  entries = 0;
+  size_entries = num_entries = deleted_entries = 0;
+
+  disk_usage = 0;
+}
+
+static void
+rescan_scratch (void)
+{
+  debug ("scratch", "event queue overflow (rescanning)");
+  scratch_rescans++;
+  release_scratch_entries ();
+  watch_directory (scratch_path);
+}
+
+/* A directory moved out of the scratch directory is not watched anymore
+ * and neither are its sub-directories.  Their entries are removed too.  If
+ * it is only renamed within the scratch directory, the following
+ * 'IN_MOVED_TO' event watches it again under its new name.
+ */
+static void
+unwatch_directory (int parent, const char * name)
+{
+  char path[PATH_MAX], * dir;
+  size_t len, pos;
+  Entry * e;
+  int wd;
+
+  if (parent < 0 || parent >= size_watched_directories ||
+      !watched_directories[parent])
+    return;
+
+  snprintf (path, sizeof path, "%s/%s", watched_directories[parent], name);
+  len = strlen (path);
+
+  for (wd = 0; wd < size_watched_directories; wd++)
+    {
+      dir = watched_directories[wd];
+      if (!dir || strncmp (dir, path, len) || (dir[len] && dir[len] != '/'))
+	continue;
+      (void) inotify_rm_watch (inotify_fd, wd);
+      free (dir);
+      watched_directories[wd] = 0;
+    }
+
+  for (pos = 0; pos < size_entries; pos++)
+    {
+      e = entries[pos];
+      if (!e || e == &deleted_entry)
+	continue;
+      if (e->wd < size_watched_directories && watched_directories[e->wd])
+	continue;
+      remove_entry (e->wd, e->name);
+    }
+}
+
+static void
+handle_scratch_event (struct inotify_event * event)
+{
+  int wd = event->wd;
+
+  if (event->mask & IN_IGNORED)
+    {
+      if (wd >= 0 && wd < size_watched_directories)
+	{
+	  free (watched_directories[wd]);
+	  watched_directories[wd] = 0;
+	}
+    }
+  else if (!event->len)
+    ;
+  else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+    add_scratch_entry (wd, event->name);
+  else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+      if ((event->mask & IN_MOVED_FROM) && (event->mask & IN_ISDIR))
+	unwatch_directory (wd, event->name);
+      remove_entry (wd, event->name);
+    }
+  else if (event->mask & IN_MODIFY)
+    mark_entry_dirty (wd, event->name);
+}
+
+static void
+update_dirty_entries (void)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  double bytes;
+  size_t i;
+  Entry * e;
+
+  for (i = 0; i < num_dirty_entries; i++)
+    {
+      e = dirty_entries[i];
+      if (e->wd < 0)
+	{
+	  free (e);
+	  continue;
+	}
+      e->dirty = 0;
+      if (!watched_directories[e->wd])
+	continue;
+      snprintf (path, sizeof path, "%s/%s", watched_directories[e->wd],
+                e->name);
+      if (!allocated_bytes (path, &st, &bytes))
+	continue;
+      disk_usage += bytes - e->bytes;
+      e->bytes = bytes;
+    }
+
+  num_dirty_entries = 0;
+}
+
+static void
+sample_scratch (void)
+{
+  char buffer[1 << 16]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  struct inotify_event * event;
+  ssize_t bytes;
+  char * p;
+  int overflow = 0;
+
+  if (inotify_fd < 0)
+    return;
+
+  while ((bytes = read (inotify_fd, buffer, sizeof buffer)) > 0)
+    for (p = buffer; p < buffer + bytes; p += sizeof *event + event->len)
+      {
+	event = (struct inotify_event *) p;
+	if (event->mask & IN_Q_OVERFLOW)
+	  overflow = 1;
+	else
+	  handle_scratch_event (event);
+      }
+
+  if (overflow)
+    rescan_scratch ();
+  else
+    update_dirty_entries ();
+
+  if (disk_usage > max_disk_usage)
+    max_disk_usage = disk_usage;
+}
+
+static int
+remove_scratch_entry (const char * path, const struct stat * st,
+                      int flag, struct FTW * ftw)
+{
+  (void) st;
+  (void) flag;
+  (void) ftw;
+  if (remove (path))
+    warning ("can not remove '%s'", path);
+  return 0;
+}
+
+/* If runlim exits with an error, e.g., while starting the child, the
+ * scratch directory is still removed, but only by runlim itself and not
+ * by a child which failed to execute the program.
+ */
+static void
+remove_scratch_at_exit (void)
+{
+  if (scratch_path && getpid () == parent_pid)
+    (void) nftw (scratch_path, remove_scratch_entry, 16,
+                 FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
+
+static void
+create_scratch (void)
+{
+  const char * parent = scratch_parent;
+  char * path;
+
+  if (!parent && !(parent = getenv ("TMPDIR")))
+    parent = "/tmp";
+
+  path = malloc (strlen (parent) + 16);
+  if (!path)
+    error ("out-of-memory allocating scratch directory path");
+  sprintf (path, "%s/runlim-XXXXXX", parent);
+  if (!mkdtemp (path))
+    error ("can not create scratch directory in '%s'", parent);
+  scratch_path = path;
+  (void) atexit (remove_scratch_at_exit);
+
+  inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0)
+    warning ("can not track size of scratch directory without 'inotify'");
+  else
+    watch_directory (scratch_path);
+
+  debug ("scratch", "%s", scratch_path);
+}
+
+/* Called after all processes terminated.  The final size is sampled before
+ * the directory is removed.
+ */
+static void
+remove_scratch (void)
+{
+  int i;
+
+  if (!scratch_path)
+    return;
+
+  sample_scratch ();
+
+  if (inotify_fd >= 0)
+    {
+      (void) close (inotify_fd);
+      inotify_fd = -1;
+    }
+  release_scratch_entries ();
+  for (i = 0; i < size_watched_directories; i++)
+    free (watched_directories[i]);
+  free (watched_directories);
+  watched_directories = 0;
+  size_watched_directories = 0;
+
+  (void) nftw (scratch_path, remove_scratch_entry, 16,
+               FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+
+  free (scratch_path);
+  scratch_path = 0;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* With '--private-tmp' the child gets its own '/tmp', a 'tmpfs' of the
+ * given size mounted in a new mount namespace, thus the program can not
+ * fill the '/tmp' of the host.  As root the child just creates the mount
+ * namespace itself.  Other users first try to create a user namespace,
+ * which only maps their own user and group, but in which the child holds
+ * all capabilities until it executes the program, which suffices to mount
+ * the 'tmpfs'.  If user namespaces are disabled, the program is executed
+ * through the setuid helper 'runlim-private-tmp' (similar to
+ * 'runlim-remount-proc').  Files in a 'tmpfs' are kept in memory, so its
+ * usage is added to the sampled memory, unless that is read from the
+ * cgroup, which already accounts for it.  The 'tmpfs' is found through
+ * '/proc/<child>/root/tmp' and kept open until the end.
+ */
+
+static long private_tmp;		/* size in MB */
+static dev_t host_tmp_device;
+static int private_tmp_fd = -1;
+static double private_tmp_memory;	/* in MB */
+static double max_private_tmp_memory;
+
+static int
+write_proc_self_file (const char * name, const char * str)
+{
+  size_t len = strlen (str);
+  char path[64];
+  int fd, res;
+
+  sprintf (path, "/proc/self/%s", name);
+  fd = open (path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  res = write (fd, str, len) == (ssize_t) len;
+  (void) close (fd);
+
+  return res;
+}
+
+/* Called in the child before executing the program.  Returns a negative
+ * number if no namespace could be created and the helper is needed.  After
+ * the child entered a user namespace the setuid bit of the helper is
+ * ignored though, thus if mounting fails afterwards, zero is returned.
+ */
+static int
+mount_private_tmp (void)
+{
+  uid_t uid = geteuid ();
+  gid_t gid = getegid ();
+  char str[64];
+
+  if (uid)
+    {
+      if (unshare (CLONE_NEWUSER | CLONE_NEWNS))
+	return -1;
+      sprintf (str, "%d %d 1", (int) uid, (int) uid);
+      if (!write_proc_self_file ("uid_map", str))
+	{
+	  warning ("can not write user map of private '/tmp' namespace");
+	  return 0;
+	}
+      (void) write_proc_self_file ("setgroups", "deny");
+      sprintf (str, "%d %d 1", (int) gid, (int) gid);
+      if (!write_proc_self_file ("gid_map", str))
+	{
+	  warning ("can not write group map of private '/tmp' namespace");
+	  return 0;
+	}
+    }
+  else if (unshare (CLONE_NEWNS))
+    return -1;
+
+  sprintf (str, "size=%ldm,mode=1777", private_tmp);
+  if (mount ("none", "/", 0, MS_REC | MS_PRIVATE, 0) ||
+      mount ("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, str))
+    {
+      warning ("can not mount private '/tmp'");
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Only returns if the helper could not be executed.
+ */
+static void
+execute_with_private_tmp_helper (char ** program)
+{
+  const char * helper_path = "runlim-private-tmp";
+  char size[32], ** argv;
+  int i, n;
+
+  for (n = 0; program[n]; n++)
+    ;
+
+  argv = malloc ((n + 3) * sizeof *argv);
+  if (!argv)
+    error ("out-of-memory allocating helper arguments");
+  argv[0] = (char *) helper_path;
+  sprintf (size, "%ld", private_tmp);
+  argv[1] = size;
+  for (i = 0; i <= n; i++)
+    argv[i + 2] = program[i];
+
+  execvp (helper_path, argv);
+  warning ("can not create private '/tmp' "
+           "(no user namespaces and no '%s')", helper_path);
+  free (argv);
+}
+
+static void
+check_private_tmp (void)
+{
+  const char * parent;
+  struct stat st;
+
+  if (!private_tmp)
+    return;
+
+  if (stat ("/tmp", &st))
+    error ("can not access '/tmp' for '--private-tmp'");
+  host_tmp_device = st.st_dev;
+
+  if (!scratch)
+    return;
+
+  if (!(parent = scratch_parent) && !(parent = getenv ("TMPDIR")))
+    parent = "/tmp";
+  if (!strcmp (parent, "/tmp") || strstr (parent, "/tmp/") == parent)
+    error ("'--private-tmp' hides scratch directory below '/tmp' "
+           "(use '--scratch=<dir>')");
+}
+
+static void
+sample_private_tmp (void)
+{
+  struct statfs fs;
+  char path[64];
+  struct stat st;
+  int fd;
+
+  if (private_tmp_fd < 0)
+    {
+      sprintf (path, "/proc/%d/root/tmp", child_pid);
+      fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0)
+	return;
+      if (fstatfs (fd, &fs) || fs.f_type != TMPFS_MAGIC ||
+          fstat (fd, &st) || st.st_dev == host_tmp_device)
+	{
+	  (void) close (fd);
+	  return;
+	}
+      private_tmp_fd = fd;
+    }
+
+  if (fstatfs (private_tmp_fd, &fs))
+    return;
+
+  private_tmp_memory =
+    (fs.f_blocks - fs.f_bfree) * (double) fs.f_bsize / (1<<20);
+  if (private_tmp_memory > max_private_tmp_memory)
+    max_private_tmp_memory = private_tmp_memory;
+}
+
+static void
+close_private_tmp (void)
+{
+  if (private_tmp_fd < 0)
+    return;
+  (void) close (private_tmp_fd);
+  private_tmp_fd = -1;
+}
+
+/*------------------------------------------------------------------------*/
+
+static void
+report (Sample * sample)
+{
+  char line[256];
+  int len;
+
+  len = snprintf (line, sizeof line,
+                  "%.2f time, %.2f real, %.0f MB, %.2f load",
+                  sample->time, sample->real, sample->memory, sample->load);
+  if (io_accounting)
+    len += snprintf (line + len, sizeof line - len,
+                     ", %.0f MB read, %.0f MB written",
+		     sample->read_bytes / (1<<20),
+		     sample->written_bytes / (1<<20));
+  if (scratch)
+    len += snprintf (line + len, sizeof line - len, ", %.0f MB disk",
+                     sample->disk / (1<<20));
+  if (perf_counters)
+    snprintf (line + len, sizeof line - len,
+              ", %.0f instructions, %.2f IPC", sample->instructions,
+	      instructions_per_cycle (sample->instructions, sample->cycles));
+  message ("sample", "%s", line);
+  num_reports++;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* Samples to be reported are handed over from the sampler thread to the
+ * reporter thread through a lock-free single producer single consumer
+ * ring buffer, thus the sampler never waits for (possibly slow) output.
+ * If the ring buffer is full the sample is not reported.
+ */
+
+#define SIZE_SAMPLES 64		/* needs to be a power of two */
+
+static Sample samples[SIZE_SAMPLES];
+static atomic_size_t head_samples;	/* only written by sampler */
+static atomic_size_t tail_samples;	/* only written by reporter */
+static sem_t samples_semaphore;
+
+static long dropped_reports;
+
+static pthread_t reporter_thread;
+static volatile int stop_reporting;
+
+static void
+push_sample (Sample * sample)
+{
+  size_t head, tail;
+  head = atomic_load_explicit (&head_samples, memory_order_relaxed);
+  tail = atomic_load_explicit (&tail_samples, memory_order_acquire);
+  if (head - tail == SIZE_SAMPLES)
+    {
+      dropped_reports++;
+      return;
+    }
+  samples[head & (SIZE_SAMPLES - 1)] = *sample;
+  atomic_store_explicit (&head_samples, head + 1, memory_order_release);
+  (void) sem_post (&samples_semaphore);
+}
+
+static int
+pop_sample (Sample * sample)
+{
+  size_t head, tail;
+  tail = atomic_load_explicit (&tail_samples, memory_order_relaxed);
+  head = atomic_load_explicit (&head_samples, memory_order_acquire);
+  if (tail == head)
+    return 0;
+  *sample = samples[tail & (SIZE_SAMPLES - 1)];
+  atomic_store_explicit (&tail_samples, tail + 1, memory_order_release);
+  return 1;
+}
+
+static void *
+report_samples (void * dummy)
+{
+  Sample sample;
+
+  (void) dummy;
+
+  for (;;)
+    {
+      while (sem_wait (&samples_semaphore) && errno == EINTR)
+	;
+      while (pop_sample (&sample))
+	report (&sample);
+      if (stop_reporting)
+	break;
+    }
+
+  return 0;
+}
+
+/*------------------------------------------------------------------------*/
+
+static void
+print_process_tree (void)
+{
+  Process * p;
+  for (p = active_processes; p; p = p->next_process)
+    if (p->descendant)
+      debug ("edge", "%d -> %d", p->ppid, p->pid);
+}
+
+/*------------------------------------------------------------------------*/
+
+static double
+sample_load (void)
+{
+  double load;
+  int res = getloadavg (&load, 1);
+  if (res != 1)
+    return 0;
+  if (load > max_load)
+    max_load = load;
+  return load;
+}
+
+/*------------------------------------------------------------------------*/
+
+static int
+histogram_bucket (double value)
+{
+  unsigned long long v;
+  int msb;
+
+  if (value < 8)
+    return value < 0 ? 0 : (int) value;
+
+  v = value;
+  msb = 63 - __builtin_clzll (v);
+  return 8 + 8 * (msb - 3) + (int) ((v >> (msb - 3)) & 7);
+}
+
+static double
+histogram_bucket_value (int bucket)
+{
+  double lower, width;
+  int msb;
+
+  if (bucket < 8)
+    return bucket;
+
+  msb = (bucket - 8) / 8 + 3;
+  width = (double) (1ull << (msb - 3));
+  lower = (8 + (bucket - 8) % 8) * width;
+
+  return lower + width / 2;
+}
+
+static void
+add_to_histogram (Histogram * h, double value)
+{
+  if (!h->count || value < h->min)
+    h->min = value;
+  if (!h->count || value > h->max)
+    h->max = value;
+  h->bucket[histogram_bucket (value)]++;
+  h->count++;
+}
+
+static double
+histogram_percentile (Histogram * h, double percentile)
+{
+  long target, seen;
+  double res;
+  int i;
+
+  if (!h->count)
+    return 0;
+
+  target = percentile * h->count / 100.0;
+  if (target >= h->count)
+    target = h->count - 1;
+
+  for (i = 0, seen = 0; seen + h->bucket[i] <= target; i++)
+    seen += h->bucket[i];
+
+  res = histogram_bucket_value (i);
+  if (res < h->min)
+    res = h->min;
+  if (res > h->max)
+    res = h->max;
+
+  return res;
+}
+
+static void
+print_histogram (const char * type, Histogram * h, const char * unit)
+{
+  if (!h->count)
+    return;
+
+  message (type, "%.0f %s min, %.0f median, %.0f p99, %.0f max",
+    h->min, unit,
+    histogram_percentile (h, 50),
+    histogram_percentile (h, 99),
+    h->max);
+}
+
+/*------------------------------------------------------------------------*/
+
+static long sample_rate = SAMPLE_RATE;
+static long report_rate = REPORT_RATE;
+
+/* With '--adaptive-sampling' the next sample interval is a quarter of the
+ * predicted time until the first limit is hit, based on the increase of
+ * time and memory usage since the last sample.  It is kept between the
+ * minimum and maximum sample rate.  Thus sampling is slow while far from
+ * all limits or idle and gets faster as usage approaches a limit or memory
+ * grows quickly.  The interval shrinks immediately but at most doubles
+ * from one sample to the next.  Reports are then printed by time (every
+ * report rate times sample rate microseconds) instead of by number of
+ * samples.
+ */
+
+static int adaptive_sampling;
+static long min_sample_rate = MIN_SAMPLE_RATE;
+static long max_sample_rate = MAX_SAMPLE_RATE;
+static long sample_interval;
+static Histogram sample_intervals;
+
+static double last_adapted_real = -1;
+static double last_adapted_time;
+static double last_adapted_memory;
+
+static double next_report_real;
+
+/* To tune the sample rate the time spent in each sample, the delay of each
+ * sample after its deadline and the overall time used by runlim itself are
+ * measured and summarized at the end.
+ */
+
+static Histogram sample_durations;
+static Histogram sample_delays;
+
+static double
+monotonic_microseconds (void)
+{
+  struct timespec ts;
+  if (clock_gettime (CLOCK_MONOTONIC, &ts))
+    return 0;
+  return 1e6 * ts.tv_sec + 1e-3 * ts.tv_nsec;
+}
+
+static double
+self_time (void)
+{
+  struct rusage u;
+  if (getrusage (RUSAGE_SELF, &u))
+    return 0;
+  return u.ru_utime.tv_sec + 1e-6 * u.ru_utime.tv_usec +
+         u.ru_stime.tv_sec + 1e-6 * u.ru_stime.tv_usec;
+}
+
+static void
+update_time_to_limit (double * until, double used, double last,
+                      double limit, double delta)
+{
+  double rate, t;
+
+  rate = (used - last) / delta;
+  if (rate <= 0)
+    return;
+
+  t = (limit - used) / rate;
+  if (t < *until)
+    *until = t;
+}
+
+static void
+adapt_sample_interval (double real)
+{
+  double until, delta, interval;
+
+  until = real_time_limit - real;
+
+  delta = real - last_adapted_real;
+  if (last_adapted_real >= 0 && delta > 0)
+    {
+      update_time_to_limit (&until,
+        sampled_time, last_adapted_time, time_limit, delta);
+      update_time_to_limit (&until,
+        sampled_memory, last_adapted_memory, space_limit, delta);
+    }
+
+  last_adapted_real = real;
+  last_adapted_time = sampled_time;
+  last_adapted_memory = sampled_memory;
+
+  interval = 1e6 * until / 4;
+  if (interval > 2 * sample_interval)
+    interval = 2 * sample_interval;
+  if (interval < min_sample_rate)
+    interval = min_sample_rate;
+  if (interval > max_sample_rate)
+    interval = max_sample_rate;
+
+  sample_interval = interval;
+  add_to_histogram (&sample_intervals, sample_interval);
+}
+
+static int
+report_due (double real)
+{
+  if (adaptive_sampling)
+    {
+      if (real < next_report_real)
+	return 0;
+      next_report_real = real + 1e-6 * report_rate * sample_rate;
+      return 1;
+    }
+
+  if (++num_samples_since_last_report < report_rate)
+    return 0;
+
+  num_samples_since_last_report = 0;
+
+  return 1;
+}
+
+static void
+sample_all_child_processes (void)
+{
+  double load, reaped, real, start;
+  long sampled, read;
+  int ignore, walk;
+  Sample sample;
+
+  assert (getpid () == parent_pid);
+
+  pthread_mutex_lock (&mutex);
+  ignore = killing;
+  pthread_mutex_unlock (&mutex);
+
+  if (ignore) return;
+
+  start = monotonic_microseconds ();
+
+  pthread_mutex_lock (&process_mutex);
+
+  load = sample_load ();
+
+  num_samples++;
+  num_reads++;
+
+  sampled_time = sampled_memory = 0;
+  memset (sampled_io, 0, sizeof sampled_io);
+
+  walk = !cgroup || debug_messages > 0 || !cgroup_memory_sampled () ||
+         io_accounting;
+
+  if (walk)
+    {
+      walked = 1;
+      read = read_processes ();
+      link_unlinked_processes ();
+
+      if (read > 0)
+	{
+	  toprint++;
+	  sampled = sample_descendants ();
+	}
+      else
+	sampled = 0;
+
+      /* debug ("sampled", "%ld processes", sampled); */
+
+      sampled += flush_inactive_processes ();
+      sampled_time += accumulated_time;
+      reaped = reaped_time ();
+      if (reaped > sampled_time)
+	sampled_time = reaped;
+    }
+  else
+    sampled = 0;
+
+  if (cgroup && sample_cgroup (&sampled_time, &sampled_memory) && !sampled)
+    sampled = 1;
+
+  if (private_tmp)
+    {
+      sample_private_tmp ();
+      if (!cgroup_memory_sampled ())
+	sampled_memory += private_tmp_memory;
+    }
+
+  if (sampled > 0)
+    {
+      if (sampled_memory > max_memory)
+	max_memory = sampled_memory;
+
+      if (sampled_time > max_time)
+	max_time = sampled_time;
+    }
+
+  real = real_time ();
+
+  if (io_accounting)
+    sample_io (real);
+
+  if (scratch)
+    sample_scratch ();
+
+  if (instruction_limit)
+    read_performance_counters ();
+
+  if (report_due (real))
+    {
+      if (sampled > 0)
+	{
+	  if (walk)
+	    print_process_tree ();
+	  if (single && debug_messages > 0)
+	    print_threads ();
+	  sample.time = sampled_time;
+	  sample.real = real;
+	  sample.memory = sampled_memory;
+	  sample.load = load;
+	  sample.read_bytes = sampled_io[READ_BYTES_IO];
+	  sample.written_bytes = sampled_io[WRITE_BYTES_IO];
+	  sample.disk = disk_usage;
+	  if (perf_counters)
+	    {
+	      if (!instruction_limit)
+		read_performance_counters ();
+	      sample.instructions = counter_values[INSTRUCTIONS_COUNTER];
+	      sample.cycles = counter_values[CYCLES_COUNTER];
+	    }
+	  push_sample (&sample);
+	}
+    }
+
+  if (adaptive_sampling)
+    adapt_sample_interval (real);
+
+  pthread_mutex_unlock (&process_mutex);
+
+  add_to_histogram (&sample_durations, monotonic_microseconds () - start);
+
+  if (sampled > 0)
+    {
+      if (sampled_time > time_limit || real > real_time_limit)
+	{
+	  if (!caught_out_of_time)
+	    {
+	      caught_out_of_time = 1;
+	      kill_all_child_processes ();
+	    }
+	}
+      else if (sampled_memory > space_limit)
+	{
+	  if (!caught_out_of_memory)
+	    {
+	      caught_out_of_memory = 1;
+	      kill_all_child_processes ();
+	    }
+	}
+      else if (io_accounting && io_limit_exceeded ())
+	{
+	  if (!caught_out_of_io)
+	    {
+	      caught_out_of_io = 1;
+	      kill_all_child_processes ();
+	    }
+	}
+      else if (disk_limit && disk_usage > disk_limit * (1<<20))
+	{
+	  if (!caught_out_of_disk)
+	    {
+	      caught_out_of_disk = 1;
+	      kill_all_child_processes ();
+	    }
+	}
+    }
+
+  if (instruction_limit &&
+      counter_values[INSTRUCTIONS_COUNTER] > instruction_limit &&
+      !caught_out_of_time && !caught_out_of_memory && !caught_out_of_io &&
+      !caught_out_of_disk && !caught_out_of_instructions)
+    {
+      caught_out_of_instructions = 1;
+      kill_all_child_processes ();
+    }
+}
+
+/*------------------------------------------------------------------------*/
+
+/* Sampling is done in a separate thread, which sleeps until absolute
+ * deadlines on the monotonic clock.  Thus samples do not drift.  If a
+ * sample takes longer than the sample rate, the missed deadlines are
+ * skipped instead of sampling twice in a row.  The main thread only waits
+ * for the child process.
+ */
+
+static pthread_t sampler_thread;
+
+static void
+add_microseconds (struct timespec * ts, long us)
+{
+  ts->tv_sec += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000)
+    {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int
+before (struct timespec * a, struct timespec * b)
+{
+  if (a->tv_sec != b->tv_sec)
+    return a->tv_sec < b->tv_sec;
+  return a->tv_nsec < b->tv_nsec;
+}
+
+static void *
+sample_periodically (void * dummy)
+{
+  struct timespec deadline, now;
+  long interval;
+  int early = 0;
+
+  (void) dummy;
+
+  watch_instruction_overflow ();
+
+  (void) clock_gettime (CLOCK_MONOTONIC, &deadline);
+
+  sample_interval = sample_rate;
+  if (sample_interval < min_sample_rate)
+    sample_interval = min_sample_rate;
+  if (sample_interval > max_sample_rate)
+    sample_interval = max_sample_rate;
+
+  /* After an early wake up by an instruction counter overflow the deadline
+   * is kept, thus regular samples stay on their grid.
+   */
+  for (;;)
+    {
+      if (!early)
+	{
+	  interval = adaptive_sampling ? sample_interval : sample_rate;
+	  add_microseconds (&deadline, interval);
+	  (void) clock_gettime (CLOCK_MONOTONIC, &now);
+	  while (!before (&now, &deadline))
+	    add_microseconds (&deadline, interval);
+	}
+
+      while (clock_nanosleep (CLOCK_MONOTONIC,
+                              TIMER_ABSTIME, &deadline, 0) == EINTR &&
+	     !caught_instruction_overflow)
+	;
+
+      early = 0;
+      if (caught_instruction_overflow)
+	{
+	  caught_instruction_overflow = 0;
+	  (void) clock_gettime (CLOCK_MONOTONIC, &now);
+	  early = before (&now, &deadline);
+	}
+      if (!early)
+	add_to_histogram (&sample_delays, monotonic_microseconds () -
+	  (1e6 * deadline.tv_sec + 1e-3 * deadline.tv_nsec));
+
+      (void) pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, 0);
+      sample_all_child_processes ();
+      (void) pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, 0);
+    }
+
+  return 0;
+}
+
+/* Signals should be delivered to the main thread only (except for the
+ * instruction counter overflow signal, see 'watch_instruction_overflow').
+ */
+static void
+start_sampling (void)
+{
+  sigset_t all, old;
+
+  if (sem_init (&samples_semaphore, 0, 0))
+    error ("can not initialize samples semaphore");
+
+  (void) sigfillset (&all);
+  (void) pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&reporter_thread, 0, report_samples, 0))
+    error ("can not start reporter thread");
+  if (pthread_create (&sampler_thread, 0, sample_periodically, 0))
+    error ("can not start sampler thread");
+  (void) pthread_sigmask (SIG_SETMASK, &old, 0);
+}
+
+static void
+stop_sampling (void)
+{
+  (void) pthread_cancel (sampler_thread);
+  (void) pthread_join (sampler_thread, 0);
+
+  stop_reporting = 1;
+  (void) sem_post (&samples_semaphore);
+  (void) pthread_join (reporter_thread, 0);
+  (void) sem_destroy (&samples_semaphore);
+
+  if (dropped_reports)
+    debug ("dropped", "%ld reports", dropped_reports);
+}
+
+/*------------------------------------------------------------------------*/
+
+static volatile int caught_usr1_signal;
+static volatile int caught_other_signal;
+
+static pthread_mutex_t caught_other_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*------------------------------------------------------------------------*/
+
+static void
+sig_usr1_handler (int s)
+{
+  assert (s == SIGUSR1);
+  caught_usr1_signal = 1;
+}
+
+static void (*old_sig_int_handler);
+static void (*old_sig_segv_handler);
+static void (*old_sig_kill_handler);
+static void (*old_sig_term_handler);
+static void (*old_sig_abrt_handler);
+
+static void restore_signal_handlers ()
+{
+  (void) signal (SIGINT, old_sig_int_handler);
+  (void) signal (SIGSEGV, old_sig_segv_handler);
+  (void) signal (SIGKILL, old_sig_kill_handler);
+  (void) signal (SIGTERM, old_sig_term_handler);
+  (void) signal (SIGABRT, old_sig_abrt_handler);
+}
+
+static void
+sig_other_handler (int s)
+{
+  int already_caught;
+  pthread_mutex_lock (&caught_other_signal_mutex);
+  already_caught = caught_other_signal;
+  caught_other_signal = 1;
+  pthread_mutex_unlock (&caught_other_signal_mutex);
+  if (already_caught) return;
+  restore_signal_handlers ();
+  kill_all_child_processes ();
+  usleep (1000);
+}
+
+/*------------------------------------------------------------------------*/
+
+static const char *
+ctime_without_new_line (time_t * t)
+{
+  const char * str, * p;
+  str = ctime (t);
+  pos_buffer = 0;
+  for (p = str; *p && *p != '\n'; p++)
+    push_buffer (*p);
+  push_buffer (0);
+  return buffer;
+}
+
+/*------------------------------------------------------------------------*/
+
+/* With '--cpus=<list>' the child is pinned to the given CPUs and with
+ * '--cores=<number>' to that many physical cores of one NUMA node (one
+ * CPU per core, hyper-threading siblings are left idle).  If both are
+ * given cores are only selected from the list.  Memory of the child is
+ * bound to the nodes of its CPUs.  In batch mode every slot gets its own
+ * disjoint set of CPUs, which are split from the list if only '--cpus' is
+ * given.  Placements are computed in runlim and applied by the child
+ * before it executes the program.
+ */
+
+struct Placement
+{
+  cpu_set_t cpus;
+  cpu_set_t nodes;		/* NUMA nodes of 'cpus' */
+};
+
+static const char * cpus_list;
+static long cores;
+
+static Placement * placements;	/* one per batch slot */
+static Placement * placement;	/* of the child (if pinned) */
+
+static cpu_set_t * node_cpus;	/* CPUs of each NUMA node */
+static int num_nodes;
+static int numa;		/* found '/sys/devices/system/node' */
+
+static int
+parse_cpu_list (const char * str, cpu_set_t * set)
+{
+  long from, to;
+  char * end;
+
+  CPU_ZERO (set);
+
+  while (*str && *str != '\n')
+    {
+      if (!isdigit ((unsigned char) *str))
+	return 0;
+      from = to = strtol (str, &end, 10);
+      str = end;
+      if (*str == '-')
+	{
+	  if (!isdigit ((unsigned char) *++str))
+	    return 0;
+	  to = strtol (str, &end, 10);
+	  str = end;
+	}
+      if (from > to || to >= CPU_SETSIZE)
+	return 0;
+      while (from <= to)
+	CPU_SET (from++, set);
+      if (*str == ',' && isdigit ((unsigned char) str[1]))
+	str++;
+      else if (*str && *str != '\n')
+	return 0;
+    }
+
+  return 1;
+}
+
+static const char *
+format_cpu_list (const cpu_set_t * set, char * str, size_t size)
+{
+  size_t pos = 0;
+  int from, to;
+
+  str[0] = 0;
+  for (from = 0; from < CPU_SETSIZE && pos < size; from = to + 1)
+    {
+      if (!CPU_ISSET (from, set))
+	{
+	  to = from;
+	  continue;
+	}
+      for (to = from; to + 1 < CPU_SETSIZE && CPU_ISSET (to + 1, set); to++)
+	;
+      pos += snprintf (str + pos, size - pos, "%s%d", pos ? "," : "", from);
+      if (to > from && pos < size)
+	pos += snprintf (str + pos, size - pos, "-%d", to);
+    }
+
+  return str;
+}
+
+static int
+read_cpu_list_file (const char * path, cpu_set_t * set)
+{
+  char line[4096];
+  FILE * file;
+  int res;
+
+  file = fopen (path, "r");
+  if (!file)
+    return 0;
+  res = fgets (line, sizeof line, file) && parse_cpu_list (line, set);
+  (void) fclose (file);
+
+  return res;
+}
+
+static void
+read_nodes (void)
+{
+  const char * nodes_path = "/sys/devices/system/node";
+  char path[320];
+  struct dirent * de;
+  cpu_set_t cpus;
+  long node;
+  DIR * dir;
+
+  dir = opendir (nodes_path);
+  if (dir)
+    {
+      while ((de = readdir (dir)))
+	{
+	  if (strncmp (de->d_name, "node", 4) ||
+	      !is_positive_long (de->d_name + 4, &node) ||
+	      node >= CPU_SETSIZE)
+	    continue;
+	  sprintf (path, "%s/%s/cpulist", nodes_path, de->d_name);
+	  if (!read_cpu_list_file (path, &cpus))
+	    continue;
+	  if (node >= num_nodes)
+	    {
+	      node_cpus = realloc (node_cpus, (node + 1) * sizeof *node_cpus);
+	      if (!node_cpus)
+		error ("out-of-memory reallocating NUMA nodes");
+	      while (num_nodes <= node)
+		CPU_ZERO (node_cpus + num_nodes++);
+	    }
+	  node_cpus[node] = cpus;
+	}
+      (void) closedir (dir);
+    }
+
+  numa = (num_nodes > 0);
+
+  if (!numa)
+    {
+      warning ("no NUMA nodes found (assuming all CPUs on one node)");
+      node_cpus = malloc (sizeof *node_cpus);
+      if (!node_cpus)
+	error ("out-of-memory allocating NUMA nodes");
+      if (sched_getaffinity (0, sizeof *node_cpus, node_cpus))
+	error ("can not determine CPUs of runlim");
+      num_nodes = 1;
+    }
+
+  debug ("nodes", "%d", num_nodes);
+}
+
+/* Marks the CPU and its hyper-threading siblings as used.
+ */
+static void
+use_core (int cpu, cpu_set_t * used)
+{
+  cpu_set_t siblings;
+  char path[128];
+
+  sprintf (path,
+    "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  if (read_cpu_list_file (path, &siblings))
+    CPU_OR (used, used, &siblings);
+  CPU_SET (cpu, used);
+}
+
+static void
+place_cores (Placement * p, long slot, const cpu_set_t * available,
+             cpu_set_t * used)
+{
+  cpu_set_t free_cores;
+  long found;
+  int node, cpu;
+
+  for (node = 0; node < num_nodes; node++)
+    {
+      found = 0;
+      CPU_ZERO (&free_cores);
+      for (cpu = 0; found < cores && cpu < CPU_SETSIZE; cpu++)
+	{
+	  if (!CPU_ISSET (cpu, node_cpus + node) ||
+	      !CPU_ISSET (cpu, available) ||
+	      CPU_ISSET (cpu, used) ||
+	      CPU_ISSET (cpu, &free_cores))
+	    continue;
+	  CPU_SET (cpu, &p->cpus);
+	  use_core (cpu, &free_cores);
+	  found++;
+	}
+      if (found == cores)
+	{
+	  CPU_OR (used, used, &free_cores);
+	  return;
+	}
+      CPU_ZERO (&p->cpus);
+    }
+
+  error ("can not find %ld free cores on one node for slot %ld",
+    cores, slot + 1);
+}
+
+static void
+place_cpus (Placement * p, long slot, long slots,
+            const cpu_set_t * available)
+{
+  long per_slot, i;
+  int cpu;
+
+  per_slot = CPU_COUNT (available) / slots;
+  if (!per_slot)
+    error ("not enough CPUs in '%s' for %ld jobs", cpus_list, slots);
+
+  i = 0;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET (cpu, available) && i++ / per_slot == slot)
+      CPU_SET (cpu, &p->cpus);
+}
+
+static void
+compute_placements (long slots)
+{
+  cpu_set_t available, list, used;
+  Placement * p;
+  long slot;
+  int node;
+
+  if (!cpus_list && !cores)
+    return;
+
+  read_nodes ();
+
+  if (sched_getaffinity (0, sizeof available, &available))
+    error ("can not determine CPUs of runlim");
+
+  if (cpus_list)
+    {
+      if (!parse_cpu_list (cpus_list, &list) || !CPU_COUNT (&list))
+	error ("invalid CPU list '%s'", cpus_list);
+      CPU_AND (&used, &list, &available);
+      if (!CPU_EQUAL (&used, &list))
+	error ("CPUs in '%s' not available to runlim", cpus_list);
+      available = list;
+    }
+
+  placements = calloc (slots, sizeof *placements);
+  if (!placements)
+    error ("out-of-memory allocating placements");
+
+  CPU_ZERO (&used);
+  for (slot = 0; slot < slots; slot++)
+    {
+      p = placements + slot;
+      if (cores)
+	place_cores (p, slot, &available, &used);
+      else
+	place_cpus (p, slot, slots, &available);
+      for (node = 0; node < num_nodes; node++)
+	{
+	  CPU_AND (&list, &p->cpus, node_cpus + node);
+	  if (CPU_COUNT (&list))
+	    CPU_SET (node, &p->nodes);
+	}
+    }
+
+  placement = placements;
+}
+
+static void
+print_placement (Placement * p, long slot)
+{
+  char cpus[4096], nodes[4096];
+
+  format_cpu_list (&p->cpus, cpus, sizeof cpus);
+  format_cpu_list (&p->nodes, nodes, sizeof nodes);
+
+  if (slot < 0)
+    {
+      message ("cpus", "%s", cpus);
+      message ("node", "%s", nodes);
+    }
+  else
+    message ("cpus", "%s on node %s (slot %ld)", cpus, nodes, slot + 1);
+}
+
+/* Called in the child before executing the program.  The node set is
+ * passed as node mask to 'set_mempolicy', which has the same bit layout
+ * as a CPU set (the kernel expects the number of bits plus one).
+ */
+static void
+apply_placement (void)
+{
+  if (sched_setaffinity (0, sizeof placement->cpus, &placement->cpus))
+    warning ("could not pin child to its CPUs");
+
+  if (numa && syscall (SYS_set_mempolicy, MPOL_BIND,
+                       &placement->nodes, CPU_SETSIZE + 1))
+    warning ("could not bind memory of child to its nodes");
+}
+
+/* The sampled maximum of memory usage misses peaks between samples.  If
+ * possible the peak tracked by the kernel is reported instead, which is
+ * 'memory.peak' of the cgroup or, if the process tree was walked and only
+ * one process was seen, its maximum resident set size as returned by
+ * 'wait'.  Otherwise that is the peak of the largest single process and
+ * thus only a lower bound of the sampled maximum.
+ */
+
+static const char * space_source = "sampled";
+
+static void
+read_peak_memory (void)
+{
+  struct rusage u;
+
+  if (cgroup_memory_sampled () && read_cgroup_peak_memory ())
+    space_source = "cgroup 'memory.peak'";
+  else if (child_pid > 0 && !private_tmp &&
+           memory_metric == RSS_METRIC &&
+           !getrusage (RUSAGE_CHILDREN, &u) && u.ru_maxrss > 0)
+    {
+      debug ("sampled space", "%.0f MB", max_memory);
+      if ((walked && children == 1) || u.ru_maxrss / 1024.0 > max_memory)
+	{
+	  max_memory = u.ru_maxrss / 1024.0;
+	  space_source = "maximum resident set size";
+	}
+    }
+}
+
+/* Waits for a child of runlim, that is the child process or an adopted
+ * orphan.  With '--io' the I/O counters are read before the process is
+ * reaped (see 'add_reaped_io').  If 'WNOHANG' is given and no process
+ * terminated, 'si_pid' is zero.  Signals handled by 'sig_other_handler'
+ * are blocked while holding the process mutex, since the handler kills all
+ * processes and thus takes the mutex too.
+ */
+static int
+wait_for_process (siginfo_t * info, int options)
+{
+  sigset_t other, old;
+  pid_t pid;
+  int res;
+
+  info->si_pid = 0;
+  if (!io_accounting)
+    return waitid (P_ALL, 0, info, WEXITED | options);
+
+  res = waitid (P_ALL, 0, info, WEXITED | WNOWAIT | options);
+  if (res || !(pid = info->si_pid))
+    return res;
+
+  (void) sigemptyset (&other);
+  (void) sigaddset (&other, SIGINT);
+  (void) sigaddset (&other, SIGTERM);
+  (void) sigaddset (&other, SIGABRT);
+  (void) pthread_sigmask (SIG_BLOCK, &other, &old);
+  pthread_mutex_lock (&process_mutex);
+  add_reaped_io (pid);
+  res = waitid (P_PID, pid, info, WEXITED);
+  pthread_mutex_unlock (&process_mutex);
+  (void) pthread_sigmask (SIG_SETMASK, &old, 0);
+
+  return res;
+}
+
+/* Runs and monitors the program and prints the summary.  The status and
+ * the caught signal are needed to propagate signals.
+ */
+
+static int
+run (char ** program, int * ok_ptr, int * signal_ptr)
+{
+  int i, res, s, ok, mounted;
+  char signal_description[80];
+  const char * description;
+  int start_pipe[2];
+  siginfo_t info;
+  double real, overhead, reaped;
+  char start;
+  time_t t;
+
+  ok = OK;				/* status of the runlim */
+  s = 0;				/* signal caught */
+  res = 0;
+
+  for (i = 0; program[i]; i++)
+    {
+      char argstr[80];
+      sprintf (argstr, "argv[%d]", i);
+      message (argstr, "%s", program[i]);
+    }
+
+  t = time (0);
+  message ("start", "%s", ctime_without_new_line (&t));
+
+  (void) signal (SIGUSR1, sig_usr1_handler);
+
+  start_time_tai = tai_time();
+  start_time = wall_clock_time();
+
+  parent_pid = getpid ();
+  group_pid = getpgid (0);
+  session_pid = getsid (0);
+
+  if (process_events && !single)
+    open_process_events ();
+  else
+    process_events = 0;
+
+  /* Reading descendants and tracked processes relies on orphans being
+   * reparented to runlim.  Otherwise background processes forked by the
+   * program are left to 'init' as without runlim.
+   */
+  if ((descendants || process_events) && prctl (PR_SET_CHILD_SUBREAPER, 1))
+    warning ("could not make runlim a child subreaper");
+
+  if (cgroup)
+    {
+      create_cgroup ();
+      if (kernel_space_limit || soft_space_limit > 0)
+	set_cgroup_memory_limits ();
+      set_cgroup_write_rate_limit ();
+    }
+
+  if (scratch)
+    create_scratch ();
+
+  /* The child waits until the parent closes the write end of this pipe,
+   * which allows to set up monitoring of the child before it executes the
+   * program.
+   */
+  if (pipe (start_pipe))
+    error ("can not create pipe to start child");
+
+  reaped_time_before_start = raw_reaped_time ();
+
+  child_pid = fork ();
+
+  if (child_pid != 0)
+    {
+      (void) close (start_pipe[0]);
+
+      if (child_pid < 0)
+	{
+	  (void) close (start_pipe[1]);
+	  ok = FORK_FAILED;
+	  res = 1;
+	}
+      else
+	{
+	  move_child_to_cgroup ();
+	  if (perf_counters)
+	    {
+	      if (instruction_limit)
+		(void) signal (SIGIO, sig_io_handler);
+	      open_performance_counters ();
+	    }
+	  (void) close (start_pipe[1]);
+
+	  old_sig_int_handler = signal (SIGINT, sig_other_handler);
+	  old_sig_segv_handler = signal (SIGSEGV, sig_other_handler);
+	  old_sig_kill_handler = signal (SIGKILL, sig_other_handler);
+	  old_sig_term_handler = signal (SIGTERM, sig_other_handler);
+	  old_sig_abrt_handler = signal (SIGABRT, sig_other_handler);
+
+	  message ("child", "%d", child_pid);
+	  debug ("group", "%d", group_pid);
+	  debug ("session", "%d", session_pid);
+	  debug ("parent", "%d", parent_pid);
+
+	  if (process_events)
+	    start_watching_process_events ();
+
+	  if (single)
+	    open_child_clock ();
+
+	  start_watching_memory_events ();
+
+	  usleep (10000);
+
+	  start_sampling ();
+
+	  /* Also reaps orphans adopted by runlim.
+	   */
+	  while (wait_for_process (&info, 0) ?
+	         errno == EINTR : info.si_pid != child_pid)
+	    ;
+
+	  stop_sampling ();
+
+	  if (info.si_pid == child_pid && info.si_code == CLD_EXITED)
+	    res = info.si_status;
+	  else if (info.si_pid == child_pid &&
+	           (info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED))
+	    {
+	      s = info.si_status;
+	      res = 128 + s;
+	      switch (s)
+		{
+		case SIGXFSZ:
+		  ok = OUT_OF_MEMORY;
+		  break;
+		case SIGXCPU:
+		  ok = OUT_OF_TIME;
+		  break;
+		case SIGSEGV:
+		  ok = SEGMENTATION_FAULT;
+		  break;
+		case SIGBUS:
+		  ok = BUS_ERROR;
+		  break;
+		default:
+		  ok = OTHER_SIGNAL;
+		  break;
+		}
+	    }
+	  else
+	    {
+	      ok = INTERNAL_ERROR;
+	      res = 1;
+	    }
+	}
+    }
+  else
+    {
+      (void) close (start_pipe[1]);
+      while (read (start_pipe[0], &start, 1) < 0 && errno == EINTR)
+	;
+      (void) close (start_pipe[0]);
+
+      if (placement)
+	apply_placement ();
+
+      if (scratch_path)
+	(void) setenv ("TMPDIR", scratch_path, 1);
+
+      if (!private_tmp)
+	execvp (program[0], program);
+      else if ((mounted = mount_private_tmp ()) < 0)
+	execute_with_private_tmp_helper (program);
+      else if (mounted)
+	execvp (program[0], program);
+      kill (getppid (), SIGUSR1);		// TODO DOES THIS WORK?
+      exit (1);
+    }
+
+  real = real_time ();
+
+  stop_watching_memory_events ();
+
+  if (caught_usr1_signal)
+    ok = EXEC_FAILED;
+  else if (caught_out_of_memory)
+    ok = OUT_OF_MEMORY;
+  else if (caught_out_of_time)
+    ok = OUT_OF_TIME;
+  else if (caught_out_of_instructions)
+    ok = OUT_OF_INSTRUCTIONS;
+  else if (caught_out_of_io)
+    ok = OUT_OF_IO;
+  else if (caught_out_of_disk)
+    ok = OUT_OF_DISK;
+
+  kill_all_child_processes ();
+
+  while (!wait_for_process (&info, WNOHANG) && info.si_pid)
+    ;
+
+  /* All processes terminated and are waited for, thus if runlim is a child
+   * subreaper the reaped time is exact.  The sampled time in contrast
+   * misses time used since the last sample of a process.  If runlim is not
+   * a child subreaper, orphans are reaped by 'init' though and then their
+   * time is missing instead.  Thus we report the maximum of both.
+   */
+  if (child_pid > 0)
+    {
+      debug ("sampled time", "%.2f seconds", max_time);
+      reaped = reaped_time ();
+      if (reaped > max_time)
+	max_time = reaped;
+      for (i = 0; io_accounting && i < NUM_IO; i++)
+	if (reaped_io[i] > max_io[i])
+	  max_io[i] = reaped_io[i];
+    }
+
+  stop_watching_process_events ();
+  close_child_clock ();
+
+  if (perf_counters)
+    read_performance_counters ();
+
+  read_peak_memory ();
+  remove_cgroup ();
+  remove_scratch ();
+  close_private_tmp ();
+
+  t = time (0);
+  message ("end", "%s", ctime_without_new_line (&t));
+
+  if (max_time >= time_limit || real_time () >= real_time_limit)
+    goto FORCE_OUT_OF_TIME_ENTRY;
+
+  if (ok == OK && instruction_limit &&
+      counter_values[INSTRUCTIONS_COUNTER] > instruction_limit)
+    ok = OUT_OF_INSTRUCTIONS;
+
+  if (ok == OK && write_limit &&
+      max_io[WRITE_BYTES_IO] > write_limit * (1<<20))
+    ok = OUT_OF_IO;
+
+  if (ok == OK && disk_limit && max_disk_usage > disk_limit * (1<<20))
+    ok = OUT_OF_DISK;
+
+  switch (ok)
+    {
+    case OK:
+      description = "ok";
+      break;
+    case OUT_OF_TIME:
+FORCE_OUT_OF_TIME_ENTRY:
+      description = "out of time";
+      res = 2;
+      break;
+    case OUT_OF_MEMORY:
+      description = "out of memory";
+      res = 3;
+      break;
+    case OUT_OF_INSTRUCTIONS:
+      description = "out of instructions";
+      res = 8;
+      break;
+    case OUT_OF_IO:
+      description = "out of io";
+      res = 9;
+      break;
+    case OUT_OF_DISK:
+      description = "out of disk";
+      res = 10;
+      break;
+    case SEGMENTATION_FAULT:
+      description = "segmentation fault";
+      res = 4;
+      break;
+    case BUS_ERROR:
+      description = "bus error";
+      res = 5;
+      break;
+    case FORK_FAILED:
+      description = "fork failed";
+      res = 6;
+      break;
+    case INTERNAL_ERROR:
+      description = "internal error";
+      res = 7;
+      break;
+    case EXEC_FAILED:
+      description = "execvp failed";
+      res = 1;
+      break;
+    default:
+      sprintf (signal_description, "signal(%d)", s);
+      description = signal_description;
+      res = 11;
+      break;
+    }
+
+  message ("status", description);
+  message ("result", "%d", res);
+  message ("children", "%d", children);
+  message ("processes", "%zu seen, %zu peak", processes, peak_processes);
+  message ("real", "%.2f seconds", real);
+  message ("time", "%.2f seconds", max_time);
+  message ("space", "%.0f MB", max_memory);
+  message ("space source", "%s", space_source);
+  if (io_accounting)
+    {
+      message ("io", "%.0f MB read, %.0f MB written",
+        max_io[READ_BYTES_IO] / (1<<20), max_io[WRITE_BYTES_IO] / (1<<20));
+      message ("io calls", "%.0f reads, %.0f writes",
+        max_io[READ_CALLS_IO], max_io[WRITE_CALLS_IO]);
+      if (!max_write_rate && real > 0)
+	max_write_rate = max_io[WRITE_BYTES_IO] / (1<<20) / real;
+      message ("write rate", "%.1f MB per second maximum", max_write_rate);
+    }
+  if (private_tmp)
+    message ("private tmp", "%.0f MB maximum", max_private_tmp_memory);
+  if (scratch)
+    {
+      message ("disk", "%.0f MB maximum", max_disk_usage / (1<<20));
+      if (scratch_rescans)
+	debug ("scratch rescans", "%ld", scratch_rescans);
+    }
+  if (perf_counters)
+    {
+      print_performance_counters ();
+      close_performance_counters ();
+    }
+  message ("load","%.2f maximum", max_load);
+  message ("samples", "%ld", num_samples);
+  if (adaptive_sampling)
+    print_histogram ("intervals", &sample_intervals, "us");
+  print_histogram ("sample time", &sample_durations, "us");
+  print_histogram ("sample delay", &sample_delays, "us");
+  overhead = self_time ();
+  message ("overhead", "%.2f seconds (%.2f%% of real time)",
+    overhead, real > 0 ? 100 * overhead / real : 0);
+  debug ("reports", "%ld", num_samples);
+  if (memory_metric != RSS_METRIC)
+    debug ("smaps reads", "%ld", smaps_reads);
+
+  if (batch_job)
+    job_message ("%ld\t%ld\t%s\t%d\t%.2f\t%.2f\t%.0f\t%s",
+      batch_job, batch_slot + 1, description, res, real, max_time,
+      max_memory, program[2]);
+
+  if (ok == OK && !propagate_exit_code)
+    res = 0;
+
+  if (process_hash_table)
+    {
+      for (size_t pos = 0; pos < size_of_process_hash_table; pos++)
+	if (process_hash_table[pos] &&
+	    process_hash_table[pos] != &deleted_process)
+	  close_stat_fd (process_hash_table[pos]);
+
+      free (process_hash_table);
+    }
+
+  release_process_blocks ();
+  release_names ();
+
+  *ok_ptr = ok;
+  *signal_ptr = s;
+
+  return res;
+}
+
+/* In batch mode a single runlim process reads jobs from a file and keeps
+ * up to '--jobs' workers running.  Each worker is a forked copy of runlim
+ * (thus host name, physical memory etc. are only determined once), which
+ * runs and monitors one job under the given limits.  As soon as a worker
+ * terminates, which is detected by blocking in 'wait', the next job is
+ * started in its slot.
+ */
+
+static const char * batch_path;
+static long jobs = 1;
+
+static char ** commands;
+static size_t size_commands;
+static size_t num_commands;
+
+static volatile sig_atomic_t caught_batch_signal;
+
+static void
+sig_batch_handler (int s)
+{
+  (void) s;
+  caught_batch_signal = 1;
+}
+
+static void
+run_job (char * command, long job, long slot)
+{
+  char * program[4];
+  int res, ok, s;
+
+  batch_job = job;
+  batch_slot = slot;
+  if (placements)
+    placement = placements + slot;
+
+  program[0] = "sh";
+  program[1] = "-c";
+  program[2] = command;
+  program[3] = 0;
+
+  /* The batch runner counts failed jobs by the exit code of workers, thus
+   * non-zero exit codes of jobs are always propagated.
+   */
+  propagate_exit_code = 1;
+
+  res = run (program, &ok, &s);
+  fflush (log);
+  exit (res);
+}
+
+/* The job file is read completely before starting any job, since
+ * workers share the file offset of an open job file.
+ */
+static void
+read_commands (void)
+{
+  char * line = 0, * command;
+  size_t size = 0, len;
+  FILE * file;
+
+  file = fopen (batch_path, "r");
+  if (!file)
+    error ("can not read jobs from '%s'", batch_path);
+
+  while (getline (&line, &size, file) > 0)
+    {
+      len = strlen (line);
+      if (len && line[len - 1] == '\n')
+	line[--len] = 0;
+      for (command = line; isspace ((unsigned char) *command); command++)
+	;
+      if (!*command || *command == '#')
+	continue;
+      if (num_commands == size_commands)
+	{
+	  size_commands = size_commands ? 2*size_commands : 64;
+	  commands = realloc (commands, size_commands * sizeof *commands);
+	  if (!commands)
+	    error ("out-of-memory reallocating jobs");
+	}
+      if (!(commands[num_commands++] = strdup (command)))
+	error ("out-of-memory copying job");
+    }
+
+  free (line);
+  (void) fclose (file);
+}
+
+static void
+release_commands (void)
+{
+  while (num_commands)
+    free (commands[--num_commands]);
+  free (commands);
+  commands = 0;
+  size_commands = 0;
+}
+
+static int
+run_batch (void)
+{
+  long started, failed, running, job, slot;
+  struct sigaction action;
+  pid_t * slots;
+  int status;
+  pid_t pid;
+
+  read_commands ();
+
+  slots = calloc (jobs, sizeof *slots);
+  if (!slots)
+    error ("out-of-memory allocating job slots");
+
+  /* Stop starting jobs and terminate running ones on interrupts.  Without
+   * 'SA_RESTART' so that 'wait' returns.
+   */
+  memset (&action, 0, sizeof action);
+  action.sa_handler = sig_batch_handler;
+  (void) sigaction (SIGINT, &action, 0);
+  (void) sigaction (SIGTERM, &action, 0);
+
+  started = failed = running = 0;
+
+  for (;;)
+    {
+      while ((size_t) started < num_commands &&
+             running < jobs && !caught_batch_signal)
+	{
+	  for (slot = 0; slots[slot]; slot++)
+	    assert (slot + 1 < jobs);
+
+	  job = ++started;
+	  fflush (log);
+	  pid = fork ();
+	  if (pid < 0)
+	    error ("could not fork job %ld", job);
+	  if (!pid)
+	    run_job (commands[job - 1], job, slot);
+
+	  debug ("job started", "%ld (pid %d, slot %ld)", job, pid, slot);
+	  slots[slot] = pid;
+	  running++;
+	}
+
+      if (!running)
+	break;
+
+      pid = wait (&status);
+      if (pid < 0)
+	{
+	  if (errno != EINTR)
+	    error ("waiting for jobs failed");
+	  if (caught_batch_signal == 1)
+	    {
+	      caught_batch_signal = 2;
+	      warning ("interrupted (terminating running jobs)");
+	      for (slot = 0; slot < jobs; slot++)
+		if (slots[slot])
+		  kill (slots[slot], SIGTERM);
+	    }
+	  continue;
+	}
+
+      for (slot = 0; slot < jobs && slots[slot] != pid; slot++)
+	;
+      if (slot == jobs)
+	continue;
 
-static void restore_signal_handlers ()
-{
-  (void) signal (SIGINT, old_sig_int_handler);
-  (void) signal (SIGSEGV, old_sig_segv_handler);
-  (void) signal (SIGKILL, old_sig_kill_handler);
-  (void) signal (SIGTERM, old_sig_term_handler);
-  (void) signal (SIGABRT, old_sig_abrt_handler);
-}
+      slots[slot] = 0;
+      running--;
 
-static void
-sig_other_handler (int s)
-{
-  int already_caught;
-  pthread_mutex_lock (&caught_other_signal_mutex);
-  already_caught = caught_other_signal;
-  caught_other_signal = 1;
-  pthread_mutex_unlock (&caught_other_signal_mutex);
-  if (already_caught) return;
-  restore_signal_handlers ();
-  kill_all_child_processes ();
-  usleep (1000);
-}
+      if (!WIFEXITED (status) || WEXITSTATUS (status))
+	failed++;
+    }
 
-/*------------------------------------------------------------------------*/
+  free (slots);
+  release_commands ();
 
-static const char *
-ctime_without_new_line (time_t * t)
-{
-  const char * str, * p;
-  str = ctime (t);
-  pos_buffer = 0;
-  for (p = str; *p && *p != '\n'; p++)
-    push_buffer (*p);
-  push_buffer (0);
-  return buffer;
+  message ("jobs", "%ld", started);
+  message ("failed", "%ld", failed);
+
+  return caught_batch_signal ? 1 : 0;
 }
 
 /*------------------------------------------------------------------------*/
@@ -1276,11 +5726,7 @@ int
 main (int argc, char **argv)
 {
   const char * log_name = 0, * tmp_name;
-  int i, j, res, status, s, ok;
-  char signal_description[80];
-  const char * description;
-  double real;
-  time_t t;
+  int i, res, s, ok;
 
   log = stderr;
   assert (!close_log);
@@ -1299,6 +5745,7 @@ main (int argc, char **argv)
 		tmp_name = argv[i];
 	        break;
 
+	      case 'j':
 	      case 'r':
 	      case 's':
 	      case 't':
@@ -1343,9 +5790,7 @@ main (int argc, char **argv)
   get_page_size ();
   get_physical_memory ();
   get_clock_ticks ();
-
-  ok = OK;				/* status of the runlim */
-  s = 0;				/* signal caught */
+  get_max_stat_fds ();
 
   time_limit = 60 * 60 * 24 * 3600;	/* one year */
   real_time_limit = time_limit;		/* same as time limit by default */
@@ -1395,6 +5840,22 @@ main (int argc, char **argv)
 	      if (sample_rate <= 0)
 		error ("invalid sample rate '%ld'", sample_rate);
 	    }
+	  else if (strcmp (argv[i], "--adaptive-sampling") == 0)
+	    {
+	      adaptive_sampling = 1;
+	    }
+	  else if (strstr (argv[i], "--min-sample-rate=") == argv[i])
+	    {
+	      min_sample_rate = parse_number_rhs (argv[i]);
+	      if (min_sample_rate <= 0)
+		error ("invalid minimum sample rate '%ld'", min_sample_rate);
+	    }
+	  else if (strstr (argv[i], "--max-sample-rate=") == argv[i])
+	    {
+	      max_sample_rate = parse_number_rhs (argv[i]);
+	      if (max_sample_rate <= 0)
+		error ("invalid maximum sample rate '%ld'", max_sample_rate);
+	    }
 	  else if (strstr (argv[i], "--report-rate=") == argv[i])
 	    {
 	      report_rate = parse_number_rhs (argv[i]);
@@ -1407,6 +5868,23 @@ main (int argc, char **argv)
 	      if (kill_delay <= 0 || kill_delay >= 1e6)
 		error ("invalid kill delay '%ld'", kill_delay);
 	    }
+	  else if (strstr (argv[i], "--memory-metric=") == argv[i])
+	    {
+	      const char * name = strchr (argv[i], '=') + 1;
+	      for (memory_metric = RSS_METRIC;
+	           memory_metric <= USS_METRIC &&
+		   strcmp (name, memory_metric_names[memory_metric]);
+		   memory_metric++)
+		;
+	      if (memory_metric > USS_METRIC)
+		error ("invalid memory metric in '%s'", argv[i]);
+	    }
+	  else if (strstr (argv[i], "--smaps-rate=") == argv[i])
+	    {
+	      smaps_rate = parse_number_rhs (argv[i]);
+	      if (smaps_rate <= 0)
+		error ("invalid smaps rate '%ld'", smaps_rate);
+	    }
 	  else if (strcmp (argv[i], "-v") == 0 ||
 	           strcmp (argv[i], "--version") == 0)
 	    {
@@ -1423,6 +5901,91 @@ main (int argc, char **argv)
 	    {
 	      single = 1;
 	    }
+	  else if (strcmp (argv[i], "--perf") == 0)
+	    {
+	      perf_counters = 1;
+	    }
+	  else if (strstr (argv[i], "--instruction-limit=") == argv[i])
+	    {
+	      instruction_limit =
+		parse_limit_rhs (argv[i], "instruction limit");
+	      perf_counters = 1;
+	    }
+	  else if (strcmp (argv[i], "--scratch") == 0)
+	    {
+	      scratch = 1;
+	    }
+	  else if (strstr (argv[i], "--scratch=") == argv[i])
+	    {
+	      scratch = 1;
+	      scratch_parent = strchr (argv[i], '=') + 1;
+	      if (!*scratch_parent)
+		error ("argument missing in '%s'", argv[i]);
+	    }
+	  else if (strstr (argv[i], "--disk-limit=") == argv[i])
+	    {
+	      disk_limit = parse_limit_rhs (argv[i], "disk limit");
+	      scratch = 1;
+	    }
+	  else if (strstr (argv[i], "--private-tmp=") == argv[i])
+	    {
+	      private_tmp = parse_limit_rhs (argv[i], "private tmp size");
+	    }
+	  else if (strcmp (argv[i], "--io") == 0)
+	    {
+	      io_accounting = 1;
+	    }
+	  else if (strstr (argv[i], "--write-limit=") == argv[i])
+	    {
+	      write_limit = parse_limit_rhs (argv[i], "write limit");
+	      io_accounting = 1;
+	    }
+	  else if (strstr (argv[i], "--write-rate-limit=") == argv[i])
+	    {
+	      write_rate_limit =
+		parse_limit_rhs (argv[i], "write rate limit");
+	      io_accounting = 1;
+	    }
+	  else if (strcmp (argv[i], "--descendants") == 0)
+	    {
+	      descendants = 1;
+	    }
+	  else if (strcmp (argv[i], "--process-events") == 0)
+	    {
+	      process_events = 1;
+	    }
+	  else if (strcmp (argv[i], "--cgroup") == 0)
+	    {
+	      cgroup = 1;
+	    }
+	  else if (strcmp (argv[i], "--kernel-space-limit") == 0)
+	    {
+	      kernel_space_limit = cgroup = 1;
+	    }
+	  else if (strstr (argv[i], "--soft-space-limit=") == argv[i])
+	    {
+	      soft_space_limit = parse_limit_rhs (argv[i], "soft space limit");
+	      cgroup = 1;
+	    }
+	  else if (strstr (argv[i], "--cgroup=") == argv[i])
+	    {
+	      cgroup = 1;
+	      cgroup_parent = strchr (argv[i], '=') + 1;
+	      if (!*cgroup_parent)
+		error ("argument missing in '%s'", argv[i]);
+	    }
+	  else if (strstr (argv[i], "--cpus=") == argv[i])
+	    {
+	      cpus_list = strchr (argv[i], '=') + 1;
+	      if (!*cpus_list)
+		error ("argument missing in '%s'", argv[i]);
+	    }
+	  else if (strstr (argv[i], "--cores=") == argv[i])
+	    {
+	      cores = parse_number_rhs (argv[i]);
+	      if (cores <= 0)
+		error ("invalid number of cores '%ld'", cores);
+	    }
 	  else if (strcmp (argv[i], "-k") == 0 ||
 	           strcmp (argv[i], "--kill") == 0)
 	    {
@@ -1433,6 +5996,24 @@ main (int argc, char **argv)
 	    {
 	      propagate_exit_code = 1;
 	    }
+	  else if (strstr (argv[i], "--batch=") == argv[i])
+	    {
+	      batch_path = strchr (argv[i], '=') + 1;
+	      if (!*batch_path)
+		error ("argument missing in '%s'", argv[i]);
+	    }
+	  else if (argv[i][1] == 'j')
+	    {
+	      jobs = parse_number_argument (&i, argc, argv);
+	      if (jobs <= 0)
+		error ("invalid number of jobs '%ld'", jobs);
+	    }
+	  else if (strstr (argv[i], "--jobs=") == argv[i])
+	    {
+	      jobs = parse_number_rhs (argv[i]);
+	      if (jobs <= 0)
+		error ("invalid number of jobs '%ld'", jobs);
+	    }
 	  else if (strcmp (argv[i], "-h") == 0 ||
 	           strcmp (argv[i], "--help") == 0)
 	    {
@@ -1446,180 +6027,58 @@ main (int argc, char **argv)
 	break;
     }
 
-  if (i >= argc)
+  if (batch_path && i < argc)
+    error ("program and '--batch' specified (try '-h')");
+
+  if (adaptive_sampling && min_sample_rate > max_sample_rate)
+    error ("minimum sample rate %ld above maximum %ld",
+      min_sample_rate, max_sample_rate);
+
+  if (!batch_path && i >= argc)
     error ("no program specified (try '-h')");
 
+  compute_placements (batch_path ? jobs : 1);
+  check_smaps_rollup ();
+  check_instruction_counter ();
+  check_private_tmp ();
+
   message ("version", "%s", VERSION);
   message ("host", "%s", read_host_name ());
+  if (placements && !batch_path)
+    print_placement (placement, -1);
+  else if (placements)
+    for (i = 0; i < jobs; i++)
+      print_placement (placements + i, i);
   message ("time limit", "%.0f seconds", time_limit);
   message ("real time limit", "%.0f seconds", real_time_limit);
   message ("space limit", "%.0f MB", space_limit);
-
-  for (j = i; j < argc; j++)
-    {
-      char argstr[80];
-      sprintf (argstr, "argv[%d]", j - i);
-      message (argstr, "%s", argv[j]);
-    }
-
-  t = time (0);
-  message ("start", "%s", ctime_without_new_line (&t));
-
-  (void) signal (SIGUSR1, sig_usr1_handler);
-
-  start_time_tai = tai_time();
-  start_time = wall_clock_time();
-
-  parent_pid = getpid ();
-  group_pid = getpgid (0);
-  session_pid = getsid (0);
-  child_pid = fork ();
-
-  if (child_pid != 0)
+  if (instruction_limit)
+    message ("instruction limit", "%ld instructions", instruction_limit);
+  if (write_limit)
+    message ("write limit", "%.0f MB", write_limit);
+  if (write_rate_limit)
+    message ("write rate limit", "%.0f MB per second", write_rate_limit);
+  if (disk_limit)
+    message ("disk limit", "%.0f MB", disk_limit);
+  if (private_tmp)
+    message ("private tmp size", "%ld MB", private_tmp);
+  if (adaptive_sampling)
+    message ("adaptive sampling", "%ld to %ld microseconds",
+      min_sample_rate, max_sample_rate);
+  if (memory_metric != RSS_METRIC)
+    message ("memory metric", "%s (read every %ld samples)",
+      memory_metric_names[memory_metric], smaps_rate);
+
+  if (batch_path)
     {
-      if (child_pid < 0)
-	{
-	  ok = FORK_FAILED;
-	  res = 1;
-	}
-      else
-	{
-	  status = 0;
-
-	  old_sig_int_handler = signal (SIGINT, sig_other_handler);
-	  old_sig_segv_handler = signal (SIGSEGV, sig_other_handler);
-	  old_sig_kill_handler = signal (SIGKILL, sig_other_handler);
-	  old_sig_term_handler = signal (SIGTERM, sig_other_handler);
-	  old_sig_abrt_handler = signal (SIGABRT, sig_other_handler);
-
-	  message ("child", "%d", child_pid);
-	  debug ("group", "%d", group_pid);
-	  debug ("session", "%d", session_pid);
-	  debug ("parent", "%d", parent_pid);
-
-	  usleep (10000);
-
-	  timer.it_interval.tv_sec  = sample_rate / 1000000;
-	  timer.it_interval.tv_usec = sample_rate % 1000000;
-	  timer.it_value = timer.it_interval;
-
-	  signal (SIGALRM, sample_all_child_processes);
-	  setitimer (ITIMER_REAL, &timer, &old_timer);
-
-	  (void) wait (&status);
-
-	  setitimer (ITIMER_REAL, &old_timer, &timer);
-
-	  if (WIFEXITED (status))
-	    res = WEXITSTATUS (status);
-	  else if (WIFSIGNALED (status))
-	    {
-	      s = WTERMSIG (status);
-	      res = 128 + s;
-	      switch (s)
-		{
-		case SIGXFSZ:
-		  ok = OUT_OF_MEMORY;
-		  break;
-		case SIGXCPU:
-		  ok = OUT_OF_TIME;
-		  break;
-		case SIGSEGV:
-		  ok = SEGMENTATION_FAULT;
-		  break;
-		case SIGBUS:
-		  ok = BUS_ERROR;
-		  break;
-		default:
-		  ok = OTHER_SIGNAL;
-		  break;
-		}
-	    }
-	  else
-	    {
-	      ok = INTERNAL_ERROR;
-	      res = 1;
-	    }
-	}
+      message ("batch", "%s", batch_path);
+      message ("parallel jobs", "%ld", jobs);
+      ok = OK;
+      s = 0;
+      res = run_batch ();
     }
   else
-    {
-      execvp (argv[i], argv + i);
-      kill (getppid (), SIGUSR1);		// TODO DOES THIS WORK?
-      exit (1);
-    }
-
-  real = real_time ();
-
-  if (caught_usr1_signal)
-    ok = EXEC_FAILED;
-  else if (caught_out_of_memory)
-    ok = OUT_OF_MEMORY;
-  else if (caught_out_of_time)
-    ok = OUT_OF_TIME;
-
-  kill_all_child_processes ();
-
-  t = time (0);
-  message ("end", "%s", ctime_without_new_line (&t));
-
-  if (max_time >= time_limit || real_time () >= real_time_limit)
-    goto FORCE_OUT_OF_TIME_ENTRY;
-
-  switch (ok)
-    {
-    case OK:
-      description = "ok";
-      break;
-    case OUT_OF_TIME:
-FORCE_OUT_OF_TIME_ENTRY:
-      description = "out of time";
-      res = 2;
-      break;
-    case OUT_OF_MEMORY:
-      description = "out of memory";
-      res = 3;
-      break;
-    case SEGMENTATION_FAULT:
-      description = "segmentation fault";
-      res = 4;
-      break;
-    case BUS_ERROR:
-      description = "bus error";
-      res = 5;
-      break;
-    case FORK_FAILED:
-      description = "fork failed";
-      res = 6;
-      break;
-    case INTERNAL_ERROR:
-      description = "internal error";
-      res = 7;
-      break;
-    case EXEC_FAILED:
-      description = "execvp failed";
-      res = 1;
-      break;
-    default:
-      sprintf (signal_description, "signal(%d)", s);
-      description = signal_description;
-      res = 11;
-      break;
-    }
-
-  message ("status", description);
-  message ("result", "%d", res);
-  message ("children", "%d", children);
-  message ("processes", "%d", processes);
-  message ("real", "%.2f seconds", real);
-  message ("time", "%.2f seconds", max_time);
-  message ("space", "%.0f MB", max_memory);
-  message ("load","%.2f maximum", max_load);
-  message ("samples", "%ld", num_samples);
-  debug ("reports", "%ld", num_samples);
-
-  if (ok == OK && !propagate_exit_code)
-    res = 0;
+    res = run (argv + i, &ok, &s);
 
   if (close_log)
     {
@@ -1631,14 +6090,8 @@ FORCE_OUT_OF_TIME_ENTRY:
   if (buffer)
     free (buffer);
 
-  if (process_hash_table)
-    {
-      for (size_t pos = 0; pos < size_of_process_hash_table; pos++)
-	if (process_hash_table[pos])
-	  free (process_hash_table[pos]);
-
-      free (process_hash_table);
-    }
+  free (placements);
+  free (node_cpus);
 
   restore_signal_handlers ();
 
@@ -1648,6 +6101,9 @@ FORCE_OUT_OF_TIME_ENTRY:
 	{
 	case OK:
 	case OUT_OF_TIME:
+	case OUT_OF_INSTRUCTIONS:
+	case OUT_OF_IO:
+	case OUT_OF_DISK:
 	case OUT_OF_MEMORY:
 	case FORK_FAILED:
 	case INTERNAL_ERROR:
@@ -0,0 +1,40 @@
+/* Deep process chain: every process forks one child until '<depth>' is
+ * reached, then the last one burns '<ms>' milliseconds.
+ * Usage: './chain [<depth> [<ms>]]'.
+ */
+
+#include "workload.h"
+
+#include <sys/wait.h>
+
+int
+main (int argc, char ** argv)
+{
+  long depth = argument (argc, argv, 1, 64);
+  long ms = argument (argc, argv, 2, 500);
+  long level = 0;
+  pid_t pid;
+
+  while (level < depth)
+    {
+      pid = fork ();
+      if (pid < 0)
+	return 1;
+      if (pid)
+	break;
+      level++;
+    }
+
+  if (level == depth)
+    burn (ms);
+  else
+    (void) waitpid (pid, 0, 0);
+
+  if (!level)
+    {
+      truth ("processes", "%ld", depth + 1);
+      truth ("time", "%.3f", used (RUSAGE_SELF) + used (RUSAGE_CHILDREN));
+    }
+
+  return 0;
+}
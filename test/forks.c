@@ -0,0 +1,45 @@
+/* Fork bomb capped in depth: every process forks two children until
+ * '<depth>' is reached, burns '<ms>' milliseconds, waits for its children
+ * and then lingers for another '<ms>' milliseconds of sleep.
+ * Usage: './forks [<depth> [<ms>]]'.
+ */
+
+#include "workload.h"
+
+#include <sys/wait.h>
+
+int
+main (int argc, char ** argv)
+{
+  long depth = argument (argc, argv, 1, 5);
+  long ms = argument (argc, argv, 2, 100);
+  struct timespec linger = { ms / 1000, (ms % 1000) * 1000000 };
+  long level = 0, processes = 1, i;
+  int root = 1;
+
+  while (level < depth)
+    {
+      for (i = 0; i < 2; i++)
+	if (!fork ())
+	  break;
+      if (i == 2)
+	break;
+      root = 0;
+      level++;
+    }
+
+  burn (ms);
+  while (wait (0) > 0)
+    ;
+  nanosleep (&linger, 0);
+
+  if (root)
+    {
+      for (i = 0; i < depth; i++)
+	processes = 2 * processes + 1;
+      truth ("processes", "%ld", processes);
+      truth ("time", "%.3f", used (RUSAGE_SELF) + used (RUSAGE_CHILDREN));
+    }
+
+  return 0;
+}
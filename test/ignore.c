@@ -0,0 +1,30 @@
+/* Ignores 'SIGTERM' and busy loops, thus has to be killed with 'SIGKILL'.
+ * With a time '<limit>' in seconds the process time used beyond the limit
+ * when receiving 'SIGTERM' is reported as enforcement latency.
+ * Usage: './ignore [<limit>]'.
+ */
+
+#include "workload.h"
+
+#include <signal.h>
+
+static volatile double limit;
+
+static void
+terminated (int sig)
+{
+  (void) sig;
+  if (limit > 0)
+    truth_seconds ("latency",
+                   seconds (CLOCK_PROCESS_CPUTIME_ID) - limit);
+}
+
+int
+main (int argc, char ** argv)
+{
+  limit = argument (argc, argv, 1, 0);
+  signal (SIGTERM, terminated);
+  for (;;)
+    burn (1000);
+  return 0;
+}
@@ -0,0 +1,65 @@
+/* Memory ramp: allocates and touches '<step>' MB every 10 milliseconds up to
+ * '<max>' MB and then holds the memory for '<hold>' seconds.  With a
+ * '<limit>' in MB the time between crossing the limit and receiving
+ * 'SIGTERM' is reported as enforcement latency.
+ * Usage: './ramp <step> <max> [<limit> [<hold>]]'.
+ */
+
+#include "workload.h"
+
+#include <signal.h>
+
+static volatile double crossed = -1;
+
+static long
+resident (void)
+{
+  long pages = 0, size;
+  FILE * file = fopen ("/proc/self/statm", "r");
+  if (!file)
+    return 0;
+  if (fscanf (file, "%ld %ld", &size, &pages) != 2)
+    pages = 0;
+  fclose (file);
+  return pages * sysconf (_SC_PAGESIZE) / (1 << 20);
+}
+
+static void
+terminated (int sig)
+{
+  (void) sig;
+  if (crossed >= 0)
+    truth_seconds ("latency", seconds (CLOCK_MONOTONIC) - crossed);
+  _exit (1);
+}
+
+int
+main (int argc, char ** argv)
+{
+  long step = argument (argc, argv, 1, 16);
+  long max = argument (argc, argv, 2, 256);
+  long limit = argument (argc, argv, 3, 0);
+  long hold = argument (argc, argv, 4, 1);
+  struct timespec tick = { 0, 10000000 };
+  long allocated = 0;
+  char * p;
+
+  signal (SIGTERM, terminated);
+
+  while (allocated < max)
+    {
+      p = malloc (step << 20);
+      if (!p)
+	return 1;
+      memset (p, 42, step << 20);
+      allocated += step;
+      if (limit && crossed < 0 && resident () > limit)
+	crossed = seconds (CLOCK_MONOTONIC);
+      nanosleep (&tick, 0);
+    }
+
+  truth ("space", "%ld", resident ());
+  sleep (hold);
+
+  return 0;
+}
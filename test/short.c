@@ -0,0 +1,35 @@
+/* Many short-lived children: forks '<n>' children one after the other, each
+ * burning '<ms>' milliseconds, which are mostly too short to be sampled.
+ * Usage: './short [<n> [<ms>]]'.
+ */
+
+#include "workload.h"
+
+#include <sys/wait.h>
+
+int
+main (int argc, char ** argv)
+{
+  long n = argument (argc, argv, 1, 200);
+  long ms = argument (argc, argv, 2, 5);
+  pid_t pid;
+  long i;
+
+  for (i = 0; i < n; i++)
+    {
+      pid = fork ();
+      if (pid < 0)
+	return 1;
+      if (!pid)
+	{
+	  burn (ms);
+	  _exit (0);
+	}
+      (void) waitpid (pid, 0, 0);
+    }
+
+  truth ("processes", "%ld", n + 1);
+  truth ("time", "%.3f", used (RUSAGE_SELF) + used (RUSAGE_CHILDREN));
+
+  return 0;
+}
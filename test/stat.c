@@ -0,0 +1,140 @@
+/* Micro benchmark comparing the single 'read' parser for '/proc/<pid>/stat'
+ * in 'runlim.c' with the previous 'fscanf' per field approach.  Both read
+ * all fields up to 'rss' of every process in '/proc' for a given number of
+ * rounds.  Usage: './stat [<rounds>]'.
+ */
+
+#ifndef VERSION
+#define VERSION "bench"
+#endif
+
+#define main runlim_main
+#include "../runlim.c"
+#undef main
+
+static int
+fscanf_process (long pid)
+{
+  unsigned long utime, stime;
+  char path[64], name[1000];
+  int rid, ppid, ch, i;
+  long rss;
+  FILE * file;
+
+  sprintf (path, "/proc/%ld/stat", pid);
+  file = fopen (path, "r");
+  if (!file)
+    return 0;
+
+#define FAILED do { fclose (file); return 0; } while (0)
+#define IGNR(TYPE,FMT) \
+  do { TYPE tmp; if (fscanf (file, FMT, &tmp) != 1) FAILED; } while (0)
+
+  if (fscanf (file, "%d", &rid) != 1) FAILED;
+  if (getc (file) != ' ') FAILED;
+  if (getc (file) != '(') FAILED;
+  i = 0;
+  while ((ch = getc (file)) != ')')
+    {
+      if (ch == EOF) FAILED;
+      if (i < 999) name[i++] = ch;
+    }
+  name[i] = 0;
+  if (getc (file) != ' ') FAILED;
+  IGNR (char, "%c");
+  if (fscanf (file, "%d", &ppid) != 1) FAILED;
+  IGNR (int, "%d");
+  IGNR (int, "%d");
+  IGNR (int, "%d");
+  IGNR (int, "%d");
+  IGNR (unsigned int, "%u");
+  IGNR (unsigned long, "%lu");
+  IGNR (unsigned long, "%lu");
+  IGNR (unsigned long, "%lu");
+  IGNR (unsigned long, "%lu");
+  if (fscanf (file, "%lu", &utime) != 1) FAILED;
+  if (fscanf (file, "%lu", &stime) != 1) FAILED;
+  IGNR (long, "%ld");
+  IGNR (long, "%ld");
+  IGNR (long, "%ld");
+  IGNR (long, "%ld");
+  IGNR (long, "%ld");
+  IGNR (long, "%ld");
+  IGNR (unsigned long long, "%llu");
+  IGNR (unsigned long, "%lu");
+  if (fscanf (file, "%ld", &rss) != 1) FAILED;
+  fclose (file);
+  return rid == pid && ppid >= 0 && utime + stime + rss >= 0;
+}
+
+static int
+read_stat_process (long pid)
+{
+  char path[64];
+  Stat s;
+  int fd, res;
+
+  sprintf (path, "/proc/%ld/stat", pid);
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  res = read_stat (fd, &s);
+  (void) close (fd);
+  return res && s.field[PID_POS] == pid;
+}
+
+static double
+bench (const char * name, int (*reader) (long), long * pids, long n, long r)
+{
+  double start, delta;
+  long i, j, read = 0;
+
+  start = wall_clock_time ();
+  for (i = 0; i < r; i++)
+    for (j = 0; j < n; j++)
+      read += reader (pids[j]);
+  delta = wall_clock_time () - start;
+
+  printf ("%-8s %8ld reads %8.3f seconds %8.2f us/read\n",
+    name, read, delta, read ? 1e6 * delta / read : 0);
+
+  return delta;
+}
+
+int
+main (int argc, char ** argv)
+{
+  long rounds = 100, n = 0, pid, * pids = 0;
+  double old, new;
+  struct dirent * de;
+  DIR * dir;
+
+  log = stderr;
+
+  if (argc > 1 && !is_positive_long (argv[1], &rounds))
+    error ("invalid number of rounds '%s'", argv[1]);
+
+  dir = opendir ("/proc");
+  if (!dir)
+    error ("can not open directory '/proc'");
+  while ((de = readdir (dir)))
+    {
+      if (!is_positive_long (de->d_name, &pid) || pid <= 0)
+	continue;
+      pids = realloc (pids, (n + 1) * sizeof *pids);
+      if (!pids)
+	error ("out-of-memory reallocating process identifiers");
+      pids[n++] = pid;
+    }
+  (void) closedir (dir);
+
+  printf ("%ld processes, %ld rounds\n", n, rounds);
+  old = bench ("fscanf", fscanf_process, pids, n, rounds);
+  new = bench ("read", read_stat_process, pids, n, rounds);
+  if (new > 0)
+    printf ("speed-up %.2f\n", old / new);
+
+  free (pids);
+
+  return 0;
+}
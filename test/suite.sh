@@ -0,0 +1,109 @@
+#!/bin/sh
+# Runs the synthetic workloads under 'runlim' and prints one tab separated
+# line per run (after a header line) with what 'runlim' reported, the
+# ground truth reported by the workload, the accounting errors, the
+# enforcement latency and the overhead of sampling.  In 'test' mode each
+# workload runs once with the default sample rate and the exit code is the
+# number of failed checks.  In 'bench' mode all workloads run with several
+# sample rates and checks are only reported.  The 'runlim' binary and
+# additional options can be set with 'RUNLIM' and 'RUNLIM_OPTIONS'.
+#
+# Usage: ./suite.sh [test|bench]
+
+mode=${1:-test}
+runlim=${RUNLIM:-../runlim}
+log=/tmp/runlim-suite-$$.log
+out=/tmp/runlim-suite-$$.out
+failed=0
+
+case $mode in
+  test) rates=100000;;
+  bench) rates="10000 100000 1000000";;
+  *) echo "usage: ./suite.sh [test|bench]" 1>&2; exit 1;;
+esac
+
+trap 'rm -f $log $out' EXIT
+
+# First word after '[runlim] <key>:', the requested word of that line or '-'.
+
+reported () {
+  sed -n "s/^\[runlim\] $1:[ 	]*//p" $log | head -1 | \
+  awk -v i=${2:-1} '{ v = $i } END { print v == "" ? "-" : v }'
+}
+
+# Value of 'truth: <key> <value>' from the workload or '-'.
+
+truth () {
+  awk -v k=$1 '$1 == "truth:" && $2 == k { v = $3 } END { print v == "" ? "-" : v }' $out
+}
+
+difference () {
+  awk -v a=$1 -v b=$2 'BEGIN { print a == "-" || b == "-" ? "-" : a - b }'
+}
+
+# Checks are 'awk' conditions over the variables of the line, that is
+# 'status', 'result', 'time_error', 'space_error', 'latency' etc.
+
+run () {
+  name=$1 rate=$2 check=$3
+  shift 3
+  $runlim --output-file=$log --sample-rate=$rate $RUNLIM_OPTIONS "$@" > $out
+  status=`sed -n 's/^\[runlim\] status:[ 	]*//p' $log | tr ' ' '-'`
+  time=`reported time`
+  space=`reported space`
+  children=`reported children`
+  truth_time=`truth time`
+  truth_space=`truth space`
+  truth_children=`truth processes`
+  line="$name	$rate	${status:--}	`reported result`	`reported real`"
+  line="$line	$time	$truth_time	`difference $time $truth_time`"
+  line="$line	$space	$truth_space	`difference $space $truth_space`"
+  line="$line	$children	$truth_children	`truth latency`"
+  line="$line	`reported samples`"
+  line="$line	`reported 'sample time' 4`	`reported 'sample time' 6`"
+  line="$line	`reported 'sample time' 8`"
+  line="$line	`reported 'sample delay' 4`	`reported 'sample delay' 6`"
+  line="$line	`reported 'sample delay' 8`	`reported overhead`"
+  if echo "$line" | awk -F '	' "{
+    status = \$3; result = \$4; real = \$5
+    time_error = \$8; space_error = \$11; latency = \$14
+    exit !($check) }"
+  then
+    echo "$line	ok"
+  else
+    echo "$line	failed"
+    failed=`expr $failed + 1`
+  fi
+}
+
+header="workload	rate	status	result	real"
+header="$header	time	truth_time	time_error"
+header="$header	space	truth_space	space_error"
+header="$header	children	truth_children	latency	samples"
+header="$header	sample_median	sample_p99	sample_max"
+header="$header	delay_median	delay_p99	delay_max	overhead	check"
+echo "$header"
+
+# Time is exact after reaping, thus allow only rounding and scheduling.
+
+exact="status == \"ok\" && time_error >= -0.05 && time_error <= 0.05 + 0.1 * \$7"
+
+for rate in $rates
+do
+  run ramp-limit $rate \
+    'status == "out-of-memory" && result == 3 && latency != "-"' \
+    --space-limit=128 ./ramp 16 512 128 10
+  run ramp $rate \
+    'status == "ok" && space_error >= -8 && space_error <= 8' \
+    ./ramp 16 256
+  run forks $rate "$exact" ./forks 4 50
+  run short $rate "$exact" ./short 200 5
+  run threads $rate "$exact" ./threads 64 20
+  run chain $rate "$exact" ./chain 64 500
+  run ignore $rate \
+    'status == "out-of-time" && result == 2 && latency != "-" && real < 3' \
+    --time-limit=1 ./ignore 1
+done
+
+[ $mode = bench ] && exit 0
+exit $failed
@@ -0,0 +1,40 @@
+/* Many threads: starts '<n>' threads each burning '<ms>' milliseconds.
+ * Usage: './threads [<n> [<ms>]]'.
+ */
+
+#include "workload.h"
+
+#include <pthread.h>
+
+static long ms;
+
+static void *
+run (void * arg)
+{
+  burn (ms);
+  return arg;
+}
+
+int
+main (int argc, char ** argv)
+{
+  long n = argument (argc, argv, 1, 64);
+  pthread_t * threads;
+  long i;
+
+  ms = argument (argc, argv, 2, 20);
+  threads = calloc (n, sizeof *threads);
+  if (!threads)
+    return 1;
+  for (i = 0; i < n; i++)
+    if (pthread_create (threads + i, 0, run, 0))
+      return 1;
+  for (i = 0; i < n; i++)
+    pthread_join (threads[i], 0);
+  free (threads);
+
+  truth ("processes", "1");
+  truth ("time", "%.3f", used (RUSAGE_SELF));
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+/* Shared helpers of the synthetic workloads used by 'suite.sh'.  Each
+ * workload prints its ground truth as 'truth: <key> <value>' lines on
+ * 'stdout' which the harness compares against what 'runlim' reports.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline double
+seconds (clockid_t clock)
+{
+  struct timespec ts;
+  if (clock_gettime (clock, &ts))
+    return 0;
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Busy loop until the calling thread used 'ms' milliseconds of CPU time.
+ */
+static inline void
+burn (long ms)
+{
+  double end = seconds (CLOCK_THREAD_CPUTIME_ID) + 1e-3 * ms;
+  volatile unsigned long count = 0;
+  while (seconds (CLOCK_THREAD_CPUTIME_ID) < end)
+    count++;
+}
+
+/* Process time of the calling process or of all its reaped descendants.
+ */
+static inline double
+used (int who)
+{
+  struct rusage u;
+  if (getrusage (who, &u))
+    return 0;
+  return u.ru_utime.tv_sec + 1e-6 * u.ru_utime.tv_usec +
+         u.ru_stime.tv_sec + 1e-6 * u.ru_stime.tv_usec;
+}
+
+/* Formats into a local buffer and writes it at once, which keeps lines of
+ * processes separate.  Since 'vsnprintf' is not async-signal-safe, signal
+ * handlers have to use 'truth_seconds' instead.
+ */
+static inline void
+truth (const char * key, const char * fmt, ...)
+{
+  char line[128];
+  va_list ap;
+  int len;
+  len = snprintf (line, sizeof line, "truth: %s ", key);
+  va_start (ap, fmt);
+  len += vsnprintf (line + len, sizeof line - len, fmt, ap);
+  va_end (ap);
+  if (len < (int) sizeof line - 1)
+    {
+      line[len++] = '\n';
+      if (write (1, line, len) < 0)
+	_exit (1);
+    }
+}
+
+/* Writes 'value' with three decimals without using 'stdio', thus can be
+ * called from signal handlers.
+ */
+static inline void
+truth_seconds (const char * key, double value)
+{
+  char line[128], digits[24];
+  long ms = value * 1e3 + (value < 0 ? -0.5 : 0.5);
+  size_t len, n = 0;
+
+  if (strlen (key) > sizeof line - sizeof digits - 16)
+    return;
+  memcpy (line, "truth: ", 7);
+  len = 7;
+  memcpy (line + len, key, strlen (key));
+  len += strlen (key);
+  line[len++] = ' ';
+  if (ms < 0)
+    {
+      line[len++] = '-';
+      ms = -ms;
+    }
+  do
+    {
+      digits[n++] = '0' + ms % 10;
+      ms /= 10;
+    }
+  while (ms || n < 4);
+  while (n)
+    {
+      line[len++] = digits[--n];
+      if (n == 3)
+	line[len++] = '.';
+    }
+  line[len++] = '\n';
+  if (write (1, line, len) < 0)
+    _exit (1);
+}
+
+static inline long
+argument (int argc, char ** argv, int i, long def)
+{
+  return i < argc ? atol (argv[i]) : def;
+}